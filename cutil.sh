@@ -31,7 +31,9 @@ while true; do
         SAME_COUNT=0
     fi
 
-    if [[ "$SAME_COUNT" -ge 5 ]]; then
+    # A supervisor restarts its own stalled workers (--stallseconds), and
+    # pkill would take it down along with every worker
+    if [[ -z "$CRAWLY_WORKERS" && "$SAME_COUNT" -ge 5 ]]; then
         echo "$(date): ⚠️ File count hasn't changed in two checks. Restarting '$PROCESS_NAME'..."
         pkill -x "$PROCESS_NAME"
         SAME_COUNT=0
@@ -41,8 +43,9 @@ while true; do
     if pgrep -x "$PROCESS_NAME" > /dev/null; then
         echo "$(date): ✅ Process '$PROCESS_NAME' is running."
     else
-        MAX_NUM=$(find ~/index/input -type f -name "*.parsed" \
-            | sed -E 's|.*/([0-9]+)\.parsed$|\1|' \
+        # Forward index segments are named <first>-<last>.fwd
+        MAX_NUM=$(find ~/index/input -type f \( -name "*.parsed" -o -name "*.fwd" \) \
+            | sed -E 's|.*/([0-9]+-)?([0-9]+)\.(parsed\|fwd)$|\2|' \
             | sort -n | tail -n 1)
 
         # If no files matched, default to 0
@@ -54,7 +57,9 @@ while true; do
         echo "$(date): ❌ Process '$PROCESS_NAME' is NOT running."
         echo "🔄 Restarting '$PROCESS_NAME' with argument $ARG..."
 
-        nohup ./build/Crawly -a $FRONTIER_IP -p $FRONTIER_PORT -o /home/wbjin/index/input -s $ARG > ~/CrawlerLog.txt 2>&1 &
+        # With CRAWLY_WORKERS set Crawly supervises its own workers and hands
+        # out doc numbers itself, -s only seeds a fresh crawly.state
+        nohup ./build/Crawly -a $FRONTIER_IP -p $FRONTIER_PORT -o /home/wbjin/index/input -s $ARG ${CRAWLY_WORKERS:+-w $CRAWLY_WORKERS} > ~/CrawlerLog.txt 2>&1 &
     fi
     PREV_NUM_FILES=$NUM_FILES
     sleep 30
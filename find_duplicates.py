@@ -12,7 +12,7 @@ def map_urls_to_filenames(directory_path):
     file_count = 0
     remove_count = 0
     for filename in os.listdir(directory_path):
-        if filename == "logs.txt":
+        if not filename.endswith(".parsed"):
             continue
         file_count+=1
 
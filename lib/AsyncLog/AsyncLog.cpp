@@ -0,0 +1,370 @@
+#include "AsyncLog.hpp"
+
+#include <sys/stat.h>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+
+// Records a thread can have waiting before new ones are dropped. Fetch
+// threads log a handful of records each, so keep rings small.
+static const size_t kRingSize = 32;
+static const uint64_t kSampleWindowMs = 1000;
+// Identical records written per window before they are only counted
+static const uint64_t kSampleBurst = 5;
+// Counters sampled keys hash into, a collision only shares a burst
+static const size_t kSampleSlots = 4096;
+static const int kCountBits = 24;
+static const uint64_t kCountMask = (uint64_t(1) << kCountBits) - 1;
+static const auto kDrainInterval = std::chrono::milliseconds(20);
+
+struct AsyncLog::Ring {
+    LogRecord slots[kRingSize];
+    // Written only by the owning thread
+    std::atomic<size_t> head{0};
+    // Written only by the drain thread
+    std::atomic<size_t> tail{0};
+    std::atomic<bool> retired{false};
+};
+
+static uint64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+static const char* levelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Warn:
+            return "warn";
+        case LogLevel::Error:
+            return "error";
+        default:
+            return "info";
+    }
+}
+
+static void appendJson(std::string& out, const std::string& str) {
+    out += '"';
+    for (char c : str) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+}
+
+AsyncLog& AsyncLog::getInstance() {
+    static AsyncLog instance;
+    return instance;
+}
+
+AsyncLog::AsyncLog()
+    : _sampleSlots(new std::atomic<uint64_t>[kSampleSlots]()) {
+    _thread = std::thread(&AsyncLog::run, this);
+}
+
+AsyncLog::~AsyncLog() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+}
+
+AsyncLog::RingHandle::RingHandle() {
+    AsyncLog& log = AsyncLog::getInstance();
+    std::lock_guard<std::mutex> lock(log._ringsMutex);
+    // Fetch threads are short lived, reuse the ring of one that has exited
+    if (log._freeRings.empty()) {
+        ring = std::make_shared<Ring>();
+    } else {
+        ring = std::move(log._freeRings.back());
+        log._freeRings.pop_back();
+        ring->retired.store(false, std::memory_order_relaxed);
+    }
+    log._rings.push_back(ring);
+}
+
+AsyncLog::RingHandle::~RingHandle() {
+    // The drain thread recycles the ring once it is empty
+    ring->retired.store(true, std::memory_order_release);
+}
+
+AsyncLog::Ring& AsyncLog::localRing() {
+    thread_local RingHandle handle;
+    return *handle.ring;
+}
+
+void AsyncLog::open(const std::string& path, size_t maxBytes, int maxFiles) {
+    std::lock_guard<std::mutex> lock(_fileMutex);
+    _path = path;
+    _maxBytes = maxBytes;
+    _maxFiles = maxFiles;
+    _file.close();
+    _file.open(_path, std::ios::app);
+    struct stat st;
+    _fileBytes = stat(_path.c_str(), &st) == 0 ? st.st_size : 0;
+    if (!_file) {
+        std::cerr << "Error opening log file " << _path << "\n";
+    }
+}
+
+void AsyncLog::log(LogLevel level, bool sampled, std::string stage,
+                   std::string errorClass, std::string url,
+                   std::string message, double durationMs) {
+    uint64_t now = nowMs();
+    size_t slot = 0;
+    uint64_t window = 0;
+    uint64_t prior = 0;
+    if (sampled) {
+        slot = std::hash<std::string>()(stage + "|" + errorClass + "|" +
+                                        message) %
+               kSampleSlots;
+        window = now / kSampleWindowMs;
+        std::atomic<uint64_t>& counter = _sampleSlots[slot];
+        uint64_t old = counter.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            if (old >> kCountBits == window) {
+                next = old + ((old & kCountMask) < kCountMask);
+            } else {
+                next = window << kCountBits | 1;
+            }
+        } while (!counter.compare_exchange_weak(old, next,
+                                                std::memory_order_relaxed));
+        if ((next & kCountMask) > kSampleBurst) {
+            // Counted, the drain thread writes a summary once the window ends
+            return;
+        }
+        // First record of a new window, it carries whatever the previous
+        // window suppressed that the drain thread has not summarized yet
+        if (old >> kCountBits != window && (old & kCountMask) > kSampleBurst) {
+            prior = (old & kCountMask) - kSampleBurst;
+        }
+    }
+
+    Ring& ring = localRing();
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    while (head - ring.tail.load(std::memory_order_acquire) >= kRingSize) {
+        if (sampled) {
+            ++_dropped;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            // Nothing drains the ring once the log is shut down
+            if (_stopping) {
+                ++_dropped;
+                return;
+            }
+            _drainRequested = true;
+        }
+        _wake.notify_one();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    LogRecord& record = ring.slots[head % kRingSize];
+    record.timeMs = now;
+    record.level = level;
+    record.stage = std::move(stage);
+    record.errorClass = std::move(errorClass);
+    record.url = std::move(url);
+    record.message = std::move(message);
+    record.durationMs = durationMs;
+    record.sampled = sampled;
+    record.sampleSlot = slot;
+    record.sampleWindow = window;
+    record.priorSuppressed = prior;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void AsyncLog::flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t request = ++_flushRequests;
+    _wake.notify_one();
+    _flushed.wait(lock, [&] { return _flushesDone >= request || _stopping; });
+}
+
+void AsyncLog::run() {
+    while (true) {
+        bool stopping;
+        uint64_t flushRequests;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait_for(lock, kDrainInterval, [this] {
+                return _stopping || _drainRequested ||
+                       _flushRequests != _flushesDone;
+            });
+            _drainRequested = false;
+            stopping = _stopping;
+            flushRequests = _flushRequests;
+        }
+        drain();
+        flushSamples(nowMs(), stopping);
+        {
+            std::lock_guard<std::mutex> lock(_fileMutex);
+            if (_file.is_open()) {
+                _file.flush();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _flushesDone = flushRequests;
+        }
+        _flushed.notify_all();
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+size_t AsyncLog::drain() {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(_ringsMutex);
+        rings = _rings;
+    }
+
+    size_t taken = 0;
+    for (auto& ring : rings) {
+        // Read before draining, a retired ring gets no more records
+        bool retired = ring->retired.load(std::memory_order_acquire);
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail < head; ++tail, ++taken) {
+            LogRecord& record = ring->slots[tail % kRingSize];
+            if (!record.sampled) {
+                write(record);
+                continue;
+            }
+            Sample& sample = _samples[record.sampleSlot];
+            if (record.priorSuppressed) {
+                write(sample.window ? sample.last : record,
+                      record.priorSuppressed);
+            }
+            write(record);
+            sample.window = record.sampleWindow;
+            sample.last = std::move(record);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        if (retired) {
+            std::lock_guard<std::mutex> lock(_ringsMutex);
+            for (size_t i = 0; i < _rings.size(); ++i) {
+                if (_rings[i] == ring) {
+                    _rings[i] = _rings.back();
+                    _rings.pop_back();
+                    _freeRings.push_back(ring);
+                    break;
+                }
+            }
+        }
+    }
+    return taken;
+}
+
+void AsyncLog::flushSamples(uint64_t now, bool all) {
+    uint64_t window = now / kSampleWindowMs;
+    for (auto it = _samples.begin(); it != _samples.end();) {
+        Sample& sample = it->second;
+        if (!all && sample.window >= window) {
+            ++it;
+            continue;
+        }
+        // Summarize what the window suppressed, then forget the slot so the
+        // map only holds recently active errors
+        uint64_t suppressed = claimSuppressed(it->first, sample.window);
+        if (suppressed) {
+            write(sample.last, suppressed);
+        }
+        it = _samples.erase(it);
+    }
+}
+
+uint64_t AsyncLog::claimSuppressed(size_t slot, uint64_t window) {
+    // Leave the count at the burst, so later repeats in the window are still
+    // suppressed and carried by the next window's first record
+    std::atomic<uint64_t>& counter = _sampleSlots[slot];
+    uint64_t old = counter.load(std::memory_order_relaxed);
+    do {
+        if (old >> kCountBits != window || (old & kCountMask) <= kSampleBurst) {
+            return 0;
+        }
+    } while (!counter.compare_exchange_weak(old, window << kCountBits |
+                                                     kSampleBurst,
+                                            std::memory_order_relaxed));
+    return (old & kCountMask) - kSampleBurst;
+}
+
+void AsyncLog::write(const LogRecord& record, uint64_t suppressed) {
+    std::string line = "{\"ts\":" + std::to_string(record.timeMs) +
+                       ",\"level\":\"" + levelName(record.level) +
+                       "\",\"stage\":";
+    appendJson(line, record.stage);
+    line += ",\"error\":";
+    appendJson(line, record.errorClass);
+    if (!record.url.empty()) {
+        line += ",\"url\":";
+        appendJson(line, record.url);
+    }
+    if (!record.message.empty()) {
+        line += ",\"msg\":";
+        appendJson(line, record.message);
+    }
+    if (record.durationMs >= 0) {
+        char ms[32];
+        std::snprintf(ms, sizeof(ms), "%.1f", record.durationMs);
+        line += ",\"ms\":";
+        line += ms;
+    }
+    if (suppressed) {
+        // record stands in for the suppressed ones
+        line += ",\"suppressed\":" + std::to_string(suppressed);
+    }
+    line += "}\n";
+
+    std::lock_guard<std::mutex> lock(_fileMutex);
+    if (!_file.is_open()) {
+        std::cerr << line;
+        return;
+    }
+    _file << line;
+    _fileBytes += line.size();
+    if (_maxBytes && _fileBytes >= _maxBytes) {
+        rotate();
+    }
+}
+
+void AsyncLog::rotate() {
+    // path -> path.1 -> ... -> path.maxFiles, the oldest is overwritten
+    _file.close();
+    for (int i = _maxFiles - 1; i >= 1; --i) {
+        std::string from = _path + "." + std::to_string(i);
+        std::string to = _path + "." + std::to_string(i + 1);
+        std::rename(from.c_str(), to.c_str());
+    }
+    if (_maxFiles > 0) {
+        std::rename(_path.c_str(), (_path + ".1").c_str());
+    }
+    _file.open(_path, std::ios::trunc);
+    _fileBytes = 0;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum class LogLevel { Info, Warn, Error };
+
+struct LogRecord {
+    uint64_t timeMs = 0;
+    LogLevel level = LogLevel::Info;
+    // Where it happened (fetch, connect, write, ...) and a short machine
+    // readable class (http_404, curl_timeout, ...)
+    std::string stage;
+    std::string errorClass;
+    std::string url;
+    std::string message;
+    // Negative when there is no timing
+    double durationMs = -1;
+    bool sampled = false;
+    // Set on sampled records by log(): the counter slot and window they were
+    // counted in, and what the slot's previous window suppressed
+    size_t sampleSlot = 0;
+    uint64_t sampleWindow = 0;
+    uint64_t priorSuppressed = 0;
+};
+
+// Structured logging for hot paths. Each thread appends to its own lock-free
+// ring buffer and a background thread drains them into JSON lines, rotating
+// the file by size. Until open() is called records go to stderr. The drain
+// thread starts on first use, so a process that forks workers must not log
+// before forking.
+class AsyncLog {
+   public:
+    static AsyncLog& getInstance();
+
+    // Write to path, keeping maxFiles rotated files of maxBytes each
+    void open(const std::string& path, size_t maxBytes = 64 << 20,
+              int maxFiles = 5);
+
+    // Sampled records are the fetch errors that come in floods. Repeats of
+    // the same stage, class and message past a small burst per second are
+    // only counted by the calling thread, and the record is dropped rather
+    // than stall the thread when its ring is full. Every other record is
+    // written, the caller waits for ring space instead.
+    void log(LogLevel level, bool sampled, std::string stage,
+             std::string errorClass, std::string url, std::string message,
+             double durationMs = -1);
+
+    void info(std::string stage, std::string errorClass, std::string url,
+              std::string message, double durationMs = -1) {
+        log(LogLevel::Info, false, std::move(stage), std::move(errorClass),
+            std::move(url), std::move(message), durationMs);
+    }
+
+    void error(std::string stage, std::string errorClass, std::string url,
+               std::string message, double durationMs = -1) {
+        log(LogLevel::Error, false, std::move(stage), std::move(errorClass),
+            std::move(url), std::move(message), durationMs);
+    }
+
+    void sampledError(std::string stage, std::string errorClass,
+                      std::string url, std::string message,
+                      double durationMs = -1) {
+        log(LogLevel::Error, true, std::move(stage), std::move(errorClass),
+            std::move(url), std::move(message), durationMs);
+    }
+
+    // Block until everything logged so far has been written
+    void flush();
+
+    // Records lost because a thread's ring was full, sampled ones unless the
+    // log was shutting down
+    uint64_t dropped() const { return _dropped; }
+
+   private:
+    struct Ring;
+
+    struct RingHandle {
+        RingHandle();
+        ~RingHandle();
+        std::shared_ptr<Ring> ring;
+    };
+
+    // Last sampled record written for a counter slot, repeated in the
+    // summary of what its window suppressed
+    struct Sample {
+        uint64_t window = 0;
+        LogRecord last;
+    };
+
+    AsyncLog();
+    ~AsyncLog();
+    AsyncLog(const AsyncLog&) = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+    static Ring& localRing();
+
+    void run();
+
+    // Drain every ring, returns the number of records taken
+    size_t drain();
+
+    void write(const LogRecord& record, uint64_t suppressed = 0);
+
+    void flushSamples(uint64_t now, bool all);
+
+    // Take the suppressed count of a slot's window, zero if it has already
+    // been taken or the slot moved on to a newer window
+    uint64_t claimSuppressed(size_t slot, uint64_t window);
+
+    void rotate();
+
+    std::atomic<uint64_t> _dropped{0};
+    // Sampled records seen per hashed key, the window number in the high
+    // bits and the count in the low ones. Repeats are counted here by the
+    // logging thread and never reach the ring.
+    std::unique_ptr<std::atomic<uint64_t>[]> _sampleSlots;
+
+    std::mutex _ringsMutex;
+    std::vector<std::shared_ptr<Ring>> _rings;
+    // Drained rings of exited threads, handed to new ones
+    std::vector<std::shared_ptr<Ring>> _freeRings;
+
+    // Only touched by the background thread after open() hands them over
+    std::mutex _fileMutex;
+    std::string _path;
+    size_t _maxBytes = 0;
+    int _maxFiles = 0;
+    std::ofstream _file;
+    size_t _fileBytes = 0;
+    std::unordered_map<size_t, Sample> _samples;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _flushed;
+    uint64_t _flushRequests = 0;
+    uint64_t _flushesDone = 0;
+    // A thread is waiting for room in its ring
+    bool _drainRequested = false;
+    bool _stopping = false;
+    std::thread _thread;
+};
@@ -0,0 +1,412 @@
+#include "AsyncWriter.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "AsyncLog.hpp"
+
+#ifdef CRAWLY_HAVE_IO_URING
+#include <liburing.h>
+#endif
+
+// Files per io_uring submission, also the ring size so a batch always fits
+static const size_t kMaxBatch = 64;
+// O_DIRECT needs buffers, offsets and lengths aligned to the block size
+static const size_t kBlockSize = 4096;
+// Registered buffers cover the common case of one parsed page
+static const size_t kNumFixedBuffers = 16;
+static const size_t kFixedBufferSize = 256 * 1024;
+
+#ifdef CRAWLY_HAVE_IO_URING
+struct AsyncWriter::UringState {
+    io_uring ring;
+    std::vector<void*> buffers;
+    std::vector<int> freeBuffers;
+    bool registered = false;
+    // Set once the ring is torn down after an error. Buffers the kernel may
+    // still read are then kept until the process exits.
+    bool failed = false;
+    std::vector<std::vector<std::string>> abandonedChunks;
+    std::vector<void*> abandonedBuffers;
+};
+#else
+struct AsyncWriter::UringState {
+    bool failed = false;
+};
+#endif
+
+// Write everything in iov past the first done bytes, retrying short writes
+static bool pwritevAll(int fd, std::vector<iovec> iov, size_t done) {
+    size_t offset = done;
+    size_t first = 0;
+    while (first < iov.size() && done >= iov[first].iov_len) {
+        done -= iov[first].iov_len;
+        ++first;
+    }
+    if (first < iov.size()) {
+        iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+        iov[first].iov_len -= done;
+    }
+    while (first < iov.size()) {
+        int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t n = pwritev(fd, iov.data() + first, count, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AsyncLog::getInstance().error("write", "pwritev", "",
+                                          strerror(errno));
+            return false;
+        }
+        offset += n;
+        while (first < iov.size() && static_cast<size_t>(n) >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            ++first;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+AsyncWriter::AsyncWriter(bool useIoUring, bool directIo,
+                         size_t directIoThreshold)
+    : _directIo(directIo), _directIoThreshold(directIoThreshold) {
+    _stats.backend = "pwritev";
+#ifdef CRAWLY_HAVE_IO_URING
+    if (useIoUring) {
+        _uring = std::make_unique<UringState>();
+        int ret = io_uring_queue_init(kMaxBatch, &_uring->ring, 0);
+        if (ret < 0) {
+            AsyncLog::getInstance().info(
+                "write", "io_uring_unavailable", "",
+                std::string(strerror(-ret)) + ", using writer thread");
+            _uring.reset();
+        } else {
+            _stats.backend = "io_uring";
+            std::vector<iovec> iov;
+            for (size_t i = 0; i < kNumFixedBuffers; ++i) {
+                void* buffer;
+                if (posix_memalign(&buffer, kBlockSize, kFixedBufferSize) != 0) {
+                    break;
+                }
+                _uring->buffers.push_back(buffer);
+                _uring->freeBuffers.push_back(i);
+                iov.push_back({buffer, kFixedBufferSize});
+            }
+            _uring->registered =
+                !iov.empty() &&
+                io_uring_register_buffers(&_uring->ring, iov.data(), iov.size()) == 0;
+        }
+    }
+#else
+    (void)useIoUring;
+#endif
+    _thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _workAvailable.notify_one();
+    _thread.join();
+#ifdef CRAWLY_HAVE_IO_URING
+    if (_uring && _uring->failed) {
+        // Late writes of the failed batch may still target these
+        _uring.release();
+    } else if (_uring) {
+        if (_uring->registered) {
+            io_uring_unregister_buffers(&_uring->ring);
+        }
+        io_uring_queue_exit(&_uring->ring);
+        for (void* buffer : _uring->buffers) {
+            free(buffer);
+        }
+    }
+#endif
+}
+
+void AsyncWriter::submit(std::string path, std::string contents,
+                         Callback done) {
+    std::vector<std::string> chunks;
+    chunks.push_back(std::move(contents));
+    submit(std::move(path), std::move(chunks), std::move(done));
+}
+
+void AsyncWriter::submit(std::string path, std::vector<std::string> chunks,
+                         Callback done) {
+    Request request;
+    request.path = std::move(path);
+    request.done = std::move(done);
+    for (const auto& chunk : chunks) {
+        request.bytes += chunk.size();
+    }
+    request.chunks = std::move(chunks);
+    request.queued = std::chrono::steady_clock::now();
+    if (_memory) {
+        _memory->charge(request.bytes);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(std::move(request));
+        ++_stats.submitted;
+        _stats.maxQueueDepth =
+            std::max(_stats.maxQueueDepth, _queue.size() + _inFlight);
+    }
+    _workAvailable.notify_one();
+}
+
+void AsyncWriter::drain() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _drained.wait(lock, [this] { return _queue.empty() && _inFlight == 0; });
+}
+
+WriterStats AsyncWriter::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    WriterStats stats = _stats;
+    stats.queueDepth = _queue.size() + _inFlight;
+    uint64_t done = stats.completed + stats.failed;
+    stats.avgLatencyMs = done ? _totalLatencyMs / done : 0;
+    return stats;
+}
+
+void AsyncWriter::run() {
+    while (true) {
+        std::vector<Request> requests;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _workAvailable.wait(lock,
+                                [this] { return _stopping || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+            while (!_queue.empty() && requests.size() < kMaxBatch) {
+                requests.push_back(std::move(_queue.front()));
+                _queue.pop_front();
+            }
+            _inFlight += requests.size();
+        }
+
+        std::vector<Prepared> batch;
+        batch.reserve(requests.size());
+        for (auto& request : requests) {
+            Prepared p;
+            p.request = &request;
+            if (prepare(p)) {
+                batch.push_back(std::move(p));
+            } else {
+                finish(p, false);
+            }
+        }
+        if (_uring && !_uring->failed) {
+            writeBatchUring(batch);
+        } else {
+            writeBatchPwritev(batch);
+        }
+    }
+}
+
+bool AsyncWriter::prepare(Prepared& p) {
+    const Request& request = *p.request;
+    std::string tmpPath = request.path + ".tmp";
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    p.direct = _directIo && request.bytes >= _directIoThreshold;
+    if (p.direct) {
+        // Not every filesystem supports O_DIRECT, fall back to buffered writes
+        p.fd = open(tmpPath.c_str(), flags | O_DIRECT, 0644);
+        if (p.fd != -1) {
+            p.length = (request.bytes + kBlockSize - 1) / kBlockSize * kBlockSize;
+            if (posix_memalign(&p.alignedBuffer, kBlockSize, p.length) != 0) {
+                p.alignedBuffer = nullptr;
+                close(p.fd);
+                p.fd = -1;
+            }
+        }
+        p.direct = p.fd != -1;
+    }
+    if (p.fd == -1) {
+        p.fd = open(tmpPath.c_str(), flags, 0644);
+    }
+    if (p.fd == -1) {
+        AsyncLog::getInstance().error("write", "open", tmpPath,
+                                      strerror(errno));
+        return false;
+    }
+
+    if (p.direct) {
+        char* out = static_cast<char*>(p.alignedBuffer);
+        for (const auto& chunk : request.chunks) {
+            std::memcpy(out, chunk.data(), chunk.size());
+            out += chunk.size();
+        }
+        std::memset(out, 0, p.length - request.bytes);
+        p.iov.push_back({p.alignedBuffer, p.length});
+    } else {
+        p.length = request.bytes;
+        for (const auto& chunk : request.chunks) {
+            if (!chunk.empty()) {
+                p.iov.push_back({const_cast<char*>(chunk.data()), chunk.size()});
+            }
+        }
+    }
+    return true;
+}
+
+void AsyncWriter::finish(Prepared& p, bool ok) {
+    const Request& request = *p.request;
+    std::string tmpPath = request.path + ".tmp";
+    if (p.fd != -1) {
+        // Drop the O_DIRECT padding
+        if (ok && p.direct && ftruncate(p.fd, request.bytes) != 0) {
+            ok = false;
+        }
+        close(p.fd);
+        p.fd = -1;
+        if (ok && std::rename(tmpPath.c_str(), request.path.c_str()) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            AsyncLog::getInstance().error("write", "write", request.path,
+                                          "Error writing file");
+            unlink(tmpPath.c_str());
+        }
+    }
+    free(p.alignedBuffer);
+    p.alignedBuffer = nullptr;
+    if (_memory) {
+        _memory->release(request.bytes);
+    }
+    // Before the request leaves _inFlight so drain() covers callbacks
+    if (request.done) {
+        request.done(ok);
+    }
+
+    double latencyMs = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - request.queued)
+                           .count();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (ok) {
+            ++_stats.completed;
+            _stats.bytes += request.bytes;
+        } else {
+            ++_stats.failed;
+        }
+        _totalLatencyMs += latencyMs;
+        _stats.maxLatencyMs = std::max(_stats.maxLatencyMs, latencyMs);
+        --_inFlight;
+    }
+    _drained.notify_all();
+}
+
+void AsyncWriter::writeBatchPwritev(std::vector<Prepared>& batch) {
+    for (auto& p : batch) {
+        finish(p, pwritevAll(p.fd, p.iov, 0));
+    }
+}
+
+#ifdef CRAWLY_HAVE_IO_URING
+void AsyncWriter::writeBatchUring(std::vector<Prepared>& batch) {
+    io_uring* ring = &_uring->ring;
+    for (auto& p : batch) {
+        io_uring_sqe* sqe = io_uring_get_sqe(ring);
+        if (!p.direct && _uring->registered && p.length <= kFixedBufferSize &&
+            !_uring->freeBuffers.empty()) {
+            p.fixedBuffer = _uring->freeBuffers.back();
+            _uring->freeBuffers.pop_back();
+            char* buffer = static_cast<char*>(_uring->buffers[p.fixedBuffer]);
+            char* out = buffer;
+            for (const auto& chunk : p.request->chunks) {
+                std::memcpy(out, chunk.data(), chunk.size());
+                out += chunk.size();
+            }
+            p.iov.assign(1, {buffer, p.length});
+            io_uring_prep_write_fixed(sqe, p.fd, buffer, p.length, 0,
+                                      p.fixedBuffer);
+        } else {
+            io_uring_prep_writev(sqe, p.fd, p.iov.data(), p.iov.size(), 0);
+        }
+        io_uring_sqe_set_data(sqe, &p);
+    }
+    int submitted = io_uring_submit(ring);
+    if (submitted < static_cast<int>(batch.size())) {
+        AsyncLog::getInstance().error(
+            "write", "io_uring_submit", "",
+            submitted < 0 ? strerror(-submitted) : "Short submit");
+        abandonUring(batch);
+        return;
+    }
+
+    for (size_t done = 0; done < batch.size(); ++done) {
+        io_uring_cqe* cqe;
+        int ret;
+        do {
+            ret = io_uring_wait_cqe(ring, &cqe);
+        } while (ret == -EINTR);
+        if (ret < 0) {
+            AsyncLog::getInstance().error("write", "io_uring_wait", "",
+                                          strerror(-ret));
+            abandonUring(batch);
+            return;
+        }
+        Prepared& p = *static_cast<Prepared*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+        if (res < 0) {
+            AsyncLog::getInstance().error("write", "io_uring_write",
+                                          p.request->path, strerror(-res));
+        }
+        // Short writes are finished synchronously
+        bool ok = res >= 0 && (static_cast<size_t>(res) == p.length ||
+                               pwritevAll(p.fd, p.iov, res));
+        finish(p, ok);
+    }
+    for (auto& p : batch) {
+        if (p.fixedBuffer != -1) {
+            _uring->freeBuffers.push_back(p.fixedBuffer);
+        }
+    }
+}
+
+void AsyncWriter::abandonUring(std::vector<Prepared>& batch) {
+    // Closing the ring cancels what is still in flight, but the kernel may
+    // keep reading this batch's buffers until the cancellation completes, so
+    // none of them are freed or reused
+    io_uring_queue_exit(&_uring->ring);
+    _uring->failed = true;
+    for (auto& p : batch) {
+        // Completed requests already closed their file
+        if (p.fd == -1) {
+            continue;
+        }
+        bool ok = pwritevAll(p.fd, p.iov, 0);
+        if (p.alignedBuffer) {
+            _uring->abandonedBuffers.push_back(p.alignedBuffer);
+            p.alignedBuffer = nullptr;
+        }
+        // Moving the vector keeps every string, and its data, where it is
+        _uring->abandonedChunks.push_back(std::move(p.request->chunks));
+        finish(p, ok);
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.backend = "pwritev";
+}
+#else
+void AsyncWriter::writeBatchUring(std::vector<Prepared>& batch) {
+    writeBatchPwritev(batch);
+}
+
+void AsyncWriter::abandonUring(std::vector<Prepared>& batch) {
+    writeBatchPwritev(batch);
+}
+#endif
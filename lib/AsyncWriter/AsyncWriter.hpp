@@ -0,0 +1,124 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MemoryBudget.hpp"
+
+struct WriterStats {
+    std::string backend;
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+    // Files queued or being written right now
+    size_t queueDepth = 0;
+    size_t maxQueueDepth = 0;
+    // Time from submit() until the file is on disk under its final name
+    double avgLatencyMs = 0;
+    double maxLatencyMs = 0;
+};
+
+// Writes whole files off the calling thread. Requests are batched and
+// submitted through io_uring when Crawly is built with liburing and the kernel
+// supports it, otherwise a dedicated thread writes them with pwritev. Every
+// file is written under <path>.tmp and renamed once complete.
+class AsyncWriter {
+   public:
+    // directIo opens files of at least directIoThreshold bytes with O_DIRECT
+    AsyncWriter(bool useIoUring = true, bool directIo = false,
+                size_t directIoThreshold = 4 << 20);
+
+    // Waits for every queued file to be written
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    // Charge queued files to budget until they are written. Set before the
+    // first submit.
+    void setMemoryBudget(MemoryBudget* budget) { _memory = budget; }
+
+    // Called on the writer thread once the file is renamed into place, or
+    // with false if it could not be written
+    using Callback = std::function<void(bool ok)>;
+
+    // Queue contents to be written to path. Only takes the queue lock, never
+    // waits on the disk.
+    void submit(std::string path, std::string contents, Callback done = nullptr);
+
+    // Same as above for a file made of several pieces, written with one
+    // vectored write
+    void submit(std::string path, std::vector<std::string> chunks,
+                Callback done = nullptr);
+
+    // Block until everything submitted so far has been written and its
+    // callback has returned
+    void drain();
+
+    WriterStats stats();
+
+   private:
+    struct Request {
+        std::string path;
+        std::vector<std::string> chunks;
+        size_t bytes = 0;
+        std::chrono::steady_clock::time_point queued;
+        Callback done;
+    };
+
+    // A request with its file opened and buffers ready for the kernel
+    struct Prepared {
+        Request* request;
+        int fd = -1;
+        std::vector<iovec> iov;
+        // Bytes handed to the kernel, padded to the block size for O_DIRECT
+        size_t length = 0;
+        size_t written = 0;
+        void* alignedBuffer = nullptr;
+        int fixedBuffer = -1;
+        bool direct = false;
+    };
+
+    struct UringState;
+
+    void run();
+
+    bool prepare(Prepared& p);
+
+    void finish(Prepared& p, bool ok);
+
+    void writeBatchPwritev(std::vector<Prepared>& batch);
+
+    void writeBatchUring(std::vector<Prepared>& batch);
+
+    // Stop using io_uring after an error and rewrite what is left of batch
+    // with pwritev
+    void abandonUring(std::vector<Prepared>& batch);
+
+    bool _directIo;
+    size_t _directIoThreshold;
+
+    std::unique_ptr<UringState> _uring;
+    MemoryBudget* _memory = nullptr;
+
+    std::mutex _mutex;
+    std::condition_variable _workAvailable;
+    std::condition_variable _drained;
+    std::deque<Request> _queue;
+    bool _stopping = false;
+    size_t _inFlight = 0;
+    WriterStats _stats;
+    double _totalLatencyMs = 0;
+
+    std::thread _thread;
+};
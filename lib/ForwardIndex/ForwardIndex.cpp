@@ -0,0 +1,321 @@
+#include "ForwardIndex.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "AsyncLog.hpp"
+#include "Varint.hpp"
+
+static const char kMagic[4] = {'C', 'F', 'W', 'D'};
+static const uint64_t kVersion = 1;
+// Rough cost of a node in the maps a pending document is held in
+static const size_t kEntryOverhead = 64;
+
+void writeParsedText(std::ostream& out, const std::string& url, uint64_t docNum,
+                     const std::vector<std::string>& title,
+                     const std::vector<std::string>& words,
+                     const std::vector<std::string>& links) {
+    out << "URL: " << url << " Doc number: " << docNum << "\n";
+    out << "<title>\n";
+    for (const auto& w : title)
+        out << w << " ";
+    out << "\n</title>\n";
+    out << "<words>\n";
+    for (const auto& w : words)
+        out << w << " ";
+    out << "\n</words>\n";
+    out << "<links>\n";
+    for (const auto& link : links)
+        out << link << "\n";
+    out << "</links>\n";
+}
+
+void writeParsedText(std::ostream& out, const ForwardDoc& doc) {
+    writeParsedText(out, doc.url, doc.docNum, doc.title, doc.words, doc.links);
+}
+
+ForwardIndexWriter::ForwardIndexWriter(std::string outputDir,
+                                       size_t docsPerSegment,
+                                       AsyncWriter* writer)
+    : _outputDir(outputDir),
+      _docsPerSegment(std::max<size_t>(docsPerSegment, 1)),
+      _writer(writer) {}
+
+ForwardIndexWriter::~ForwardIndexWriter() {
+    flush();
+}
+
+ForwardIndexWriter::TermPositions ForwardIndexWriter::groupTerms(
+    const std::vector<std::string>& words) {
+    TermPositions grouped;
+    for (uint32_t pos = 0; pos < words.size(); ++pos) {
+        grouped[words[pos]].push_back(pos);
+    }
+    return grouped;
+}
+
+std::map<uint32_t, std::vector<uint32_t>> ForwardIndexWriter::assignIds(
+    Segment& segment, TermPositions& field) {
+    std::map<uint32_t, std::vector<uint32_t>> byId;
+    for (auto& [term, positions] : field) {
+        auto it = segment.dictionary.find(term);
+        uint32_t id;
+        if (it == segment.dictionary.end()) {
+            id = segment.terms.size();
+            segment.dictionary.emplace(term, id);
+            segment.terms.push_back(term);
+        } else {
+            id = it->second;
+        }
+        byId.emplace(id, std::move(positions));
+    }
+    return byId;
+}
+
+void ForwardIndexWriter::addDocument(uint64_t docNum, const std::string& url,
+                                     const std::vector<std::string>& title,
+                                     const std::vector<std::string>& words,
+                                     const std::vector<std::string>& links) {
+    // Hash and group every occurrence outside the lock so only one dictionary
+    // lookup per distinct term is serialized
+    TermPositions titleTerms = groupTerms(title);
+    TermPositions bodyTerms = groupTerms(words);
+
+    // Terms already in the dictionary are counted again, erring high
+    size_t bytes = sizeof(PendingDoc) + url.size();
+    for (const auto& link : links) {
+        bytes += sizeof(std::string) + link.size();
+    }
+    for (const auto* field : {&titleTerms, &bodyTerms}) {
+        for (const auto& [term, positions] : *field) {
+            bytes += kEntryOverhead + term.size() +
+                     positions.size() * sizeof(uint32_t);
+        }
+    }
+    if (_memory) {
+        _memory->charge(bytes);
+    }
+
+    Segment full;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        PendingDoc doc;
+        doc.docNum = docNum;
+        doc.url = url;
+        doc.links = links;
+        doc.titleLength = title.size();
+        doc.bodyLength = words.size();
+        doc.title = assignIds(_segment, titleTerms);
+        doc.body = assignIds(_segment, bodyTerms);
+        _segment.docs.push_back(std::move(doc));
+        _segment.bytes += bytes;
+        if (_segment.docs.size() < _docsPerSegment) {
+            return;
+        }
+        std::swap(full, _segment);
+    }
+    writeSegment(full);
+}
+
+void ForwardIndexWriter::flush() {
+    Segment full;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_segment.docs.empty()) {
+            return;
+        }
+        std::swap(full, _segment);
+    }
+    writeSegment(full);
+}
+
+static void putField(std::string& out, uint32_t length,
+                     const std::map<uint32_t, std::vector<uint32_t>>& field) {
+    putVarint(out, length);
+    putVarint(out, field.size());
+    uint32_t prevId = 0;
+    for (const auto& [id, positions] : field) {
+        putVarint(out, id - prevId);
+        prevId = id;
+        putVarint(out, positions.size());
+        uint32_t prevPos = 0;
+        for (uint32_t pos : positions) {
+            putVarint(out, pos - prevPos);
+            prevPos = pos;
+        }
+    }
+}
+
+void ForwardIndexWriter::writeSegment(Segment& segment) {
+    std::string out(kMagic, sizeof(kMagic));
+    putVarint(out, kVersion);
+    putVarint(out, segment.terms.size());
+    for (const auto& term : segment.terms) {
+        putString(out, term);
+    }
+    putVarint(out, segment.docs.size());
+    uint64_t firstDocNum = segment.docs.front().docNum;
+    uint64_t lastDocNum = firstDocNum;
+    for (const auto& doc : segment.docs) {
+        firstDocNum = std::min(firstDocNum, doc.docNum);
+        lastDocNum = std::max(lastDocNum, doc.docNum);
+        putVarint(out, doc.docNum);
+        putString(out, doc.url);
+        putVarint(out, doc.links.size());
+        for (const auto& link : doc.links) {
+            putString(out, link);
+        }
+        putField(out, doc.titleLength, doc.title);
+        putField(out, doc.bodyLength, doc.body);
+    }
+
+    // From here the encoded segment stands in for the pending documents, the
+    // writer charges it while queued
+    if (_memory) {
+        _memory->release(segment.bytes);
+    }
+
+    // The last number lets a restart pick up after this segment
+    std::string path = _outputDir + "/" + std::to_string(firstDocNum) + "-" +
+                       std::to_string(lastDocNum) + ".fwd";
+    if (_writer) {
+        _writer->submit(path, std::move(out));
+        return;
+    }
+
+    // Write under a temporary name so readers never see a partial segment
+    std::string tmpPath = path + ".tmp";
+    std::ofstream outFile(tmpPath, std::ios::binary);
+    if (!outFile) {
+        AsyncLog::getInstance().error("write", "segment_open", tmpPath,
+                                      "Error opening segment");
+        return;
+    }
+    outFile.write(out.data(), out.size());
+    outFile.close();
+    if (!outFile || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        AsyncLog::getInstance().error("write", "segment_write", path,
+                                      "Error writing segment");
+    }
+}
+
+ForwardIndexReader::ForwardIndexReader(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Error opening " + path);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    _data = buffer.str();
+
+    const char* data = _data.data();
+    size_t size = _data.size();
+    size_t pos = sizeof(kMagic);
+    uint64_t version, numTerms, numDocs;
+    if (size < sizeof(kMagic) ||
+        !std::equal(kMagic, kMagic + sizeof(kMagic), data) ||
+        !getVarint(data, size, pos, version) || version != kVersion ||
+        !getVarint(data, size, pos, numTerms)) {
+        throw std::runtime_error("Not a forward index segment " + path);
+    }
+    // Every term takes at least its length byte, a larger count is corrupt
+    if (numTerms > size - pos) {
+        throw std::runtime_error("Bad term count in " + path);
+    }
+    _terms.resize(numTerms);
+    for (auto& term : _terms) {
+        if (!getString(data, size, pos, term)) {
+            throw std::runtime_error("Truncated term dictionary " + path);
+        }
+    }
+    if (!getVarint(data, size, pos, numDocs)) {
+        throw std::runtime_error("Truncated segment " + path);
+    }
+
+    // Skip over each document once to build the docNum -> offset table
+    for (uint64_t i = 0; i < numDocs; ++i) {
+        uint64_t docNum, count, value;
+        std::string str;
+        size_t offset = pos;
+        bool ok = getVarint(data, size, pos, docNum) &&
+                  getString(data, size, pos, str) &&
+                  getVarint(data, size, pos, count);
+        for (uint64_t l = 0; ok && l < count; ++l) {
+            ok = getString(data, size, pos, str);
+        }
+        for (int field = 0; ok && field < 2; ++field) {
+            uint64_t length, distinct, positions = 0;
+            ok = getVarint(data, size, pos, length) &&
+                 getVarint(data, size, pos, distinct);
+            for (uint64_t t = 0; ok && t < distinct; ++t) {
+                ok = getVarint(data, size, pos, value) &&
+                     getVarint(data, size, pos, count);
+                for (uint64_t p = 0; ok && p < count; ++p) {
+                    ok = getVarint(data, size, pos, value);
+                }
+                positions += count;
+            }
+            // Every word of a field has exactly one position, decode()
+            // allocates length words on the strength of this check
+            if (ok && positions != length) {
+                throw std::runtime_error("Bad field length in " + path);
+            }
+        }
+        if (!ok) {
+            throw std::runtime_error("Truncated document in " + path);
+        }
+        _docs[docNum] = offset;
+        _order.push_back(docNum);
+    }
+}
+
+std::vector<uint64_t> ForwardIndexReader::docNums() const {
+    return _order;
+}
+
+std::optional<ForwardDoc> ForwardIndexReader::document(uint64_t docNum) const {
+    auto it = _docs.find(docNum);
+    if (it == _docs.end()) {
+        return std::nullopt;
+    }
+    return decode(it->second);
+}
+
+ForwardDoc ForwardIndexReader::decode(size_t offset) const {
+    // Offsets were validated in the constructor
+    const char* data = _data.data();
+    size_t size = _data.size();
+    size_t pos = offset;
+    ForwardDoc doc;
+    uint64_t count;
+    getVarint(data, size, pos, doc.docNum);
+    getString(data, size, pos, doc.url);
+    getVarint(data, size, pos, count);
+    doc.links.resize(count);
+    for (auto& link : doc.links) {
+        getString(data, size, pos, link);
+    }
+    for (auto* field : {&doc.title, &doc.words}) {
+        uint64_t length, distinct, id = 0;
+        getVarint(data, size, pos, length);
+        getVarint(data, size, pos, distinct);
+        field->resize(length);
+        for (uint64_t t = 0; t < distinct; ++t) {
+            uint64_t delta, position = 0;
+            getVarint(data, size, pos, delta);
+            id += delta;
+            getVarint(data, size, pos, count);
+            for (uint64_t p = 0; p < count; ++p) {
+                getVarint(data, size, pos, delta);
+                position += delta;
+                if (position < length && id < _terms.size()) {
+                    (*field)[position] = _terms[id];
+                }
+            }
+        }
+    }
+    return doc;
+}
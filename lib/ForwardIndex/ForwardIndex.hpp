@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AsyncWriter.hpp"
+
+// A document as it appears in a forward index segment
+struct ForwardDoc {
+    uint64_t docNum = 0;
+    std::string url;
+    std::vector<std::string> title;
+    std::vector<std::string> words;
+    std::vector<std::string> links;
+};
+
+// Write a document in the .parsed text format the indexer reads
+void writeParsedText(std::ostream& out, const std::string& url, uint64_t docNum,
+                     const std::vector<std::string>& title,
+                     const std::vector<std::string>& words,
+                     const std::vector<std::string>& links);
+
+void writeParsedText(std::ostream& out, const ForwardDoc& doc);
+
+// Segment layout (<firstDocNum>-<lastDocNum>.fwd), all integers are varints:
+//
+//   "CFWD" version
+//   numTerms { term }                         term dictionary, index = termID
+//   numDocs  { docNum url numLinks { link } title body }
+//
+// where title and body are encoded as
+//
+//   length numDistinct { termID-delta count { position-delta } }
+//
+// with termIDs ascending and positions ascending within each term.
+class ForwardIndexWriter {
+   public:
+    // Segments are handed to writer when given, otherwise written by the
+    // thread that filled them
+    ForwardIndexWriter(std::string outputDir, size_t docsPerSegment,
+                       AsyncWriter* writer = nullptr);
+
+    ~ForwardIndexWriter();
+
+    // Charge the documents buffered in the current segment to budget until
+    // the segment is handed off. Set before the first addDocument.
+    void setMemoryBudget(MemoryBudget* budget) { _memory = budget; }
+
+    // Add a document to the current segment. Safe to call from many threads,
+    // the segment is written out once it holds docsPerSegment documents.
+    void addDocument(uint64_t docNum, const std::string& url,
+                     const std::vector<std::string>& title,
+                     const std::vector<std::string>& words,
+                     const std::vector<std::string>& links);
+
+    // Write out whatever is in the current segment
+    void flush();
+
+   private:
+    // A field grouped by term, built without holding the lock
+    using TermPositions = std::unordered_map<std::string, std::vector<uint32_t>>;
+
+    struct PendingDoc {
+        uint64_t docNum;
+        std::string url;
+        std::vector<std::string> links;
+        uint32_t titleLength;
+        uint32_t bodyLength;
+        // termID -> positions
+        std::map<uint32_t, std::vector<uint32_t>> title;
+        std::map<uint32_t, std::vector<uint32_t>> body;
+    };
+
+    struct Segment {
+        std::vector<std::string> terms;
+        std::unordered_map<std::string, uint32_t> dictionary;
+        std::vector<PendingDoc> docs;
+        // Estimated memory held, charged to _memory
+        size_t bytes = 0;
+    };
+
+    static TermPositions groupTerms(const std::vector<std::string>& words);
+
+    static std::map<uint32_t, std::vector<uint32_t>> assignIds(
+        Segment& segment, TermPositions& field);
+
+    void writeSegment(Segment& segment);
+
+    std::string _outputDir;
+    size_t _docsPerSegment;
+    AsyncWriter* _writer;
+    MemoryBudget* _memory = nullptr;
+
+    std::mutex _mutex;
+    Segment _segment;
+};
+
+class ForwardIndexReader {
+   public:
+    // Throws std::runtime_error if the file can not be read or is malformed
+    ForwardIndexReader(const std::string& path);
+
+    size_t size() const { return _docs.size(); }
+
+    const std::vector<std::string>& terms() const { return _terms; }
+
+    // Document numbers in this segment in the order they were written
+    std::vector<uint64_t> docNums() const;
+
+    std::optional<ForwardDoc> document(uint64_t docNum) const;
+
+   private:
+    ForwardDoc decode(size_t offset) const;
+
+    std::string _data;
+    std::vector<std::string> _terms;
+    // docNum -> offset of the document in _data
+    std::map<uint64_t, size_t> _docs;
+    std::vector<uint64_t> _order;
+};
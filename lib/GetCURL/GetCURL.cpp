@@ -1,5 +1,7 @@
 #include "GetCURL.hpp"
 
+#include "AsyncLog.hpp"
+
 GetCURL& GetCURL::getInstance() {
     static GetCURL instance;
     return instance;
@@ -21,7 +23,8 @@ size_t write_callback(void* contents, size_t size, size_t nmemb, std::string* ou
 std::optional<std::string> GetCURL::getHtml(std::string url) {
     CURL* curl = curl_easy_init();
     if (!curl) {
-        std::cerr << "Error curl easy init\n";
+        AsyncLog::getInstance().sampledError("fetch", "curl_init", url,
+                                             "Error curl easy init");
         return std::nullopt;
     }
 
@@ -49,27 +52,36 @@ std::optional<std::string> GetCURL::getHtml(std::string url) {
 
     long response_code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    double totalSeconds = 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &totalSeconds);
+    double totalMs = totalSeconds * 1000;
 
     curl_slist_free_all(headers);
     curl_easy_cleanup(curl);
 
     if (response_code == 404) {
-        std::cerr << "Page not found (404) " << url << "\n";
+        AsyncLog::getInstance().sampledError("fetch", "http_404", url,
+                                             "Page not found", totalMs);
         return std::nullopt;
     }
 
     if (response_code >= 400) {
-        std::cerr << "HTTP error: " << response_code << " for " << url << "\n";
+        AsyncLog::getInstance().sampledError(
+            "fetch", "http_" + std::to_string(response_code), url,
+            "HTTP error", totalMs);
         return std::nullopt;
     }
 
     if (res != CURLE_OK) {
-        std::cerr << "CURL error for " << url << ": " << curl_easy_strerror(res) << "\n";
+        AsyncLog::getInstance().sampledError("fetch",
+                                             "curl_" + std::to_string(res), url,
+                                             curl_easy_strerror(res), totalMs);
         return std::nullopt;
     }
 
     if (response == "") {
-        std::cerr << "Response html is empty " << url << " \n";
+        AsyncLog::getInstance().sampledError("fetch", "empty_response", url,
+                                             "Response html is empty", totalMs);
         return std::nullopt;
     }
     return response;
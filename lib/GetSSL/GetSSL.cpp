@@ -6,10 +6,9 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <iostream>
 #include <vector>
 
-using std::cout, std::endl;
+#include "AsyncLog.hpp"
 
 ParsedUrl::ParsedUrl(const char* url) {
     // Assumes url points to static text but
@@ -83,7 +82,8 @@ GetSSL::GetSSL(std::string url)
 
     int status = getaddrinfo(_parsedUrl.Host, _parsedUrl.Port, &hints, &res);
     if (status != 0) {
-        std::cerr << "getaddrinfo error: " << gai_strerror(status) << std::endl;
+        AsyncLog::getInstance().sampledError("connect", "getaddrinfo", url,
+                                             gai_strerror(status));
         _valid = false;
         return;
     }
@@ -91,7 +91,8 @@ GetSSL::GetSSL(std::string url)
     // Create a TCP/IP socket.
     _sockFd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (_sockFd == -1) {
-        std::cerr << "Error creating socket\n";
+        AsyncLog::getInstance().sampledError("connect", "socket", url,
+                                             "Error creating socket");
         freeaddrinfo(res);
         return;
     }
@@ -103,7 +104,8 @@ GetSSL::GetSSL(std::string url)
 
     // Connect the socket to the host address.
     if (connect(_sockFd, res->ai_addr, res->ai_addrlen) == -1) {
-        std::cerr << "GETSSL: Error connecting to" + url + "\n";
+        AsyncLog::getInstance().sampledError("connect", "connect", url,
+                                             "Error connecting");
         close(_sockFd);
         freeaddrinfo(res);
         _valid = false;
@@ -114,7 +116,8 @@ GetSSL::GetSSL(std::string url)
     // to the socket we've connected.
     SSL_set_fd(_ssl, _sockFd);
     if (SSL_connect(_ssl) != 1) {
-        std::cerr << "SSL handshake failed " << url << "\n";
+        AsyncLog::getInstance().sampledError("connect", "ssl_handshake", url,
+                                             "SSL handshake failed");
         SSL_free(_ssl);
         close(_sockFd);
         SSL_CTX_free(_ctx);
@@ -149,7 +152,8 @@ std::optional<std::string> GetSSL::getHtml() {
     // Send message
     if (SSL_write(_ssl, request.c_str(), request.length()) <= 0) {
         _valid = false;
-        std::cerr << "Error sending request\n";
+        AsyncLog::getInstance().sampledError("fetch", "send", _url,
+                                             "Error sending request");
         SSL_shutdown(_ssl);
         SSL_free(_ssl);
         close(_sockFd);
@@ -194,11 +198,12 @@ std::vector<std::string> GetSSL::getRobots() {
                           "Connection: close\r\n"
                           "User-Agent: wbjin@umich.edu\r\n"
                           "\r\n";
-    cout << request << endl;
+    AsyncLog::getInstance().info("robots", "request", robotsUrl, request);
 
     if (SSL_write(_ssl, request.c_str(), request.length()) <= 0) {
         _valid = false;
-        std::cerr << "Error sending request\n";
+        AsyncLog::getInstance().sampledError("fetch", "send", _url,
+                                             "Error sending request");
         SSL_shutdown(_ssl);
         SSL_free(_ssl);
         close(_sockFd);
@@ -212,15 +217,20 @@ std::vector<std::string> GetSSL::getRobots() {
 
     int ssl_error = SSL_get_error(_ssl, 0);
     if (ssl_error == SSL_ERROR_ZERO_RETURN) {
-        std::cerr << "SSL connection closed cleanly by the server\n";
+        AsyncLog::getInstance().info(
+            "robots", "ssl_closed", robotsUrl,
+            "SSL connection closed cleanly by the server");
     } else if (ssl_error == SSL_ERROR_SYSCALL) {
-        std::cerr << "SSL syscall error: " << strerror(errno) << std::endl;
+        AsyncLog::getInstance().error("robots", "ssl_syscall", robotsUrl,
+                                      strerror(errno));
     } else {
-        std::cerr << "SSL error: " << ssl_error << std::endl;
+        AsyncLog::getInstance().error("robots", "ssl_error", robotsUrl,
+                                      "SSL error " + std::to_string(ssl_error));
     }
 
     while ((bytesReceived = SSL_read(_ssl, buffer, sizeof(buffer) - 1)) > 0) {
-        cout << bytesReceived << endl;
+        AsyncLog::getInstance().info("robots", "read", robotsUrl,
+                                     std::to_string(bytesReceived) + " bytes");
         buffer[bytesReceived] = '\0';
         response.append(buffer, bytesReceived);
     }
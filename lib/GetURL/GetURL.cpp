@@ -6,9 +6,10 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <iostream>
 #include <vector>
 
+#include "AsyncLog.hpp"
+
 GetURL::GetURL(std::string url)
     : _parsedUrl(ParsedUrl(url.c_str())), _url(url) {
     // Get the host address.
@@ -20,7 +21,8 @@ GetURL::GetURL(std::string url)
 
     int status = getaddrinfo(_parsedUrl.Host, _parsedUrl.Port, &hints, &res);
     if (status != 0) {
-        std::cerr << "getaddrinfo error: " << gai_strerror(status) << std::endl;
+        AsyncLog::getInstance().sampledError("connect", "getaddrinfo", url,
+                                             gai_strerror(status));
         _valid = false;
         return;
     }
@@ -28,7 +30,8 @@ GetURL::GetURL(std::string url)
     // Create a TCP/IP socket.
     _sockFd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (_sockFd == -1) {
-        std::cerr << "Error creating socket\n";
+        AsyncLog::getInstance().sampledError("connect", "socket", url,
+                                             "Error creating socket");
         freeaddrinfo(res);
         return;
     }
@@ -40,7 +43,8 @@ GetURL::GetURL(std::string url)
 
     // Connect the socket to the host address.
     if (connect(_sockFd, res->ai_addr, res->ai_addrlen) == -1) {
-        std::cerr << "GetURL: Error connecting to server\n";
+        AsyncLog::getInstance().sampledError("connect", "connect", url,
+                                             "Error connecting to server");
         close(_sockFd);
         freeaddrinfo(res);
         _valid = false;
@@ -74,7 +78,9 @@ std::optional<std::string> GetURL::getHtml() {
     while (totalSent < requestLength) {
         ssize_t bytesSent = send(_sockFd, request.c_str() + totalSent, requestLength - totalSent, 0);
         if (bytesSent < 0) {
-            std::cerr << "Error sending request: " << strerror(errno) << "\n";
+            AsyncLog::getInstance().error("fetch", "send", _url,
+                                          strerror(errno));
+            AsyncLog::getInstance().flush();
             close(_sockFd);
             exit(EXIT_FAILURE);
         }
@@ -0,0 +1,354 @@
+#include "LinkGraph.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "AsyncLog.hpp"
+#include "Varint.hpp"
+
+static const char kGraphMagic[4] = {'C', 'L', 'G', 'R'};
+static const char kUrlMagic[4] = {'C', 'L', 'U', 'R'};
+static const uint32_t kVersion = 1;
+
+// Anchor text past this is not useful for ranking and would let one page blow
+// up the 32-bit anchor offsets
+static const size_t kMaxAnchorLength = 256;
+// Rough cost of a node in the url map
+static const size_t kEntryOverhead = 64;
+
+uint64_t urlFingerprint(const std::string& url) {
+    size_t end = url.find('#');
+    if (end == std::string::npos) {
+        end = url.size();
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < end; ++i) {
+        hash ^= static_cast<uint8_t>(url[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The form of url the table stores, matching what urlFingerprint hashes
+static std::string withoutFragment(const std::string& url) {
+    return url.substr(0, url.find('#'));
+}
+
+LinkGraphWriter::LinkGraphWriter(std::string outputDir, size_t docsPerSegment,
+                                 AsyncWriter* writer)
+    : _outputDir(outputDir),
+      _docsPerSegment(std::max<size_t>(docsPerSegment, 1)),
+      _writer(writer) {}
+
+LinkGraphWriter::~LinkGraphWriter() {
+    flush();
+}
+
+void LinkGraphWriter::addDocument(uint64_t docNum, const std::string& url,
+                                  const std::vector<OutLink>& links) {
+    PendingDoc doc;
+    doc.docNum = docNum;
+    doc.fingerprint = urlFingerprint(url);
+    std::vector<std::pair<uint64_t, const OutLink*>> targets;
+    for (const auto& link : links) {
+        targets.emplace_back(urlFingerprint(link.url), &link);
+    }
+    // Keep the first occurrence of each target, it is usually the most
+    // prominent anchor on the page
+    std::stable_sort(targets.begin(), targets.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (const auto& [fingerprint, link] : targets) {
+        if (!doc.edges.empty() && doc.edges.back().fingerprint == fingerprint) {
+            continue;
+        }
+        doc.edges.push_back(
+            {fingerprint, link->anchorText.substr(0, kMaxAnchorLength)});
+    }
+
+    // Urls already in the segment are counted again, erring high
+    size_t bytes = sizeof(PendingDoc) + kEntryOverhead + url.size();
+    for (const auto& edge : doc.edges) {
+        bytes += sizeof(Edge) + edge.anchorText.size();
+    }
+    for (const auto& link : links) {
+        bytes += kEntryOverhead + link.url.size();
+    }
+    if (_memory) {
+        _memory->charge(bytes);
+    }
+
+    Segment full;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _segment.bytes += bytes;
+        _segment.urls.emplace(doc.fingerprint, withoutFragment(url));
+        for (const auto& [fingerprint, link] : targets) {
+            _segment.urls.emplace(fingerprint, withoutFragment(link->url));
+        }
+        _segment.docs.push_back(std::move(doc));
+        if (_segment.docs.size() < _docsPerSegment) {
+            return;
+        }
+        std::swap(full, _segment);
+    }
+    writeSegment(full);
+}
+
+void LinkGraphWriter::flush() {
+    Segment full;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_segment.docs.empty()) {
+            return;
+        }
+        std::swap(full, _segment);
+    }
+    writeSegment(full);
+}
+
+template <typename T>
+static void putRaw(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static bool writeFile(const std::string& path, const std::string& contents) {
+    // Write under a temporary name so readers never map a partial segment
+    std::string tmpPath = path + ".tmp";
+    std::ofstream outFile(tmpPath, std::ios::binary);
+    if (!outFile) {
+        AsyncLog::getInstance().error("write", "segment_open", tmpPath,
+                                      "Error opening segment");
+        return false;
+    }
+    outFile.write(contents.data(), contents.size());
+    outFile.close();
+    if (!outFile || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        AsyncLog::getInstance().error("write", "segment_write", path,
+                                      "Error writing segment");
+        return false;
+    }
+    return true;
+}
+
+void LinkGraphWriter::writeSegment(Segment& segment) {
+    std::sort(segment.docs.begin(), segment.docs.end(),
+              [](const auto& a, const auto& b) { return a.docNum < b.docNum; });
+
+    std::vector<GraphDoc> docs;
+    std::vector<uint32_t> anchorOffsets;
+    std::string edges;
+    std::string anchors;
+    for (const auto& doc : segment.docs) {
+        docs.push_back({doc.docNum, doc.fingerprint, edges.size(),
+                        static_cast<uint32_t>(anchorOffsets.size()),
+                        static_cast<uint32_t>(doc.edges.size())});
+        uint64_t prev = 0;
+        for (const auto& edge : doc.edges) {
+            putVarint(edges, edge.fingerprint - prev);
+            prev = edge.fingerprint;
+            anchorOffsets.push_back(anchors.size());
+            anchors.append(edge.anchorText);
+        }
+    }
+    anchorOffsets.push_back(anchors.size());
+
+    GraphHeader header;
+    std::memcpy(header.magic, kGraphMagic, sizeof(kGraphMagic));
+    header.version = kVersion;
+    header.numDocs = docs.size();
+    header.numEdges = anchorOffsets.size() - 1;
+    header.edgeBytes = edges.size();
+    header.anchorBytes = anchors.size();
+
+    std::string graph;
+    putRaw(graph, header);
+    graph.append(reinterpret_cast<const char*>(docs.data()),
+                 docs.size() * sizeof(GraphDoc));
+    graph.append(reinterpret_cast<const char*>(anchorOffsets.data()),
+                 anchorOffsets.size() * sizeof(uint32_t));
+
+    std::vector<std::pair<uint64_t, const std::string*>> urls;
+    for (const auto& [fingerprint, url] : segment.urls) {
+        urls.emplace_back(fingerprint, &url);
+    }
+    std::sort(urls.begin(), urls.end());
+
+    UrlTableHeader urlHeader;
+    std::memcpy(urlHeader.magic, kUrlMagic, sizeof(kUrlMagic));
+    urlHeader.version = kVersion;
+    urlHeader.numUrls = urls.size();
+
+    std::string table;
+    std::string blob;
+    putRaw(table, urlHeader);
+    for (const auto& [fingerprint, url] : urls) {
+        putRaw(table, UrlEntry{fingerprint, blob.size()});
+        blob.append(*url);
+    }
+    putRaw(table, UrlEntry{0, blob.size()});
+
+    // From here the encoded files stand in for the pending documents, the
+    // writer charges them while queued
+    if (_memory) {
+        _memory->release(segment.bytes);
+    }
+
+    std::string base = _outputDir + "/" + std::to_string(docs.front().docNum);
+    if (_writer) {
+        _writer->submit(base + ".urls", {std::move(table), std::move(blob)});
+        _writer->submit(base + ".graph",
+                        {std::move(graph), std::move(edges), std::move(anchors)});
+        return;
+    }
+    writeFile(base + ".urls", table + blob);
+    writeFile(base + ".graph", graph + edges + anchors);
+}
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Error opening " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error("Error reading " + path);
+    }
+    _size = st.st_size;
+    if (_size > 0) {
+        void* mapped = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Error mapping " + path);
+        }
+        _data = static_cast<const char*>(mapped);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (_data) {
+        munmap(const_cast<char*>(_data), _size);
+    }
+}
+
+LinkGraphReader::LinkGraphReader(const std::string& path) : _file(path) {
+    _header = reinterpret_cast<const GraphHeader*>(_file.data());
+    if (_file.size() < sizeof(GraphHeader) ||
+        std::memcmp(_header->magic, kGraphMagic, sizeof(kGraphMagic)) != 0 ||
+        _header->version != kVersion) {
+        throw std::runtime_error("Not a link graph segment " + path);
+    }
+    // Bound each count by the file size first so the sum can not overflow
+    size_t size = _file.size();
+    if (_header->numDocs > size / sizeof(GraphDoc) ||
+        _header->numEdges >= size / sizeof(uint32_t) ||
+        _header->edgeBytes > size || _header->anchorBytes > size) {
+        throw std::runtime_error("Bad link graph header " + path);
+    }
+    size_t docsBytes = _header->numDocs * sizeof(GraphDoc);
+    size_t offsetsBytes = (_header->numEdges + 1) * sizeof(uint32_t);
+    if (size != sizeof(GraphHeader) + docsBytes + offsetsBytes +
+                    _header->edgeBytes + _header->anchorBytes) {
+        throw std::runtime_error("Truncated link graph segment " + path);
+    }
+    const char* p = _file.data() + sizeof(GraphHeader);
+    _docs = reinterpret_cast<const GraphDoc*>(p);
+    _anchorOffsets = reinterpret_cast<const uint32_t*>(p + docsBytes);
+    _edges = p + docsBytes + offsetsBytes;
+    _anchors = _edges + _header->edgeBytes;
+
+    // edges() trusts these, check them once here
+    for (uint64_t i = 0; i < _header->numDocs; ++i) {
+        const GraphDoc& doc = _docs[i];
+        if (doc.edgeOffset > _header->edgeBytes ||
+            static_cast<uint64_t>(doc.firstEdge) + doc.numEdges >
+                _header->numEdges) {
+            throw std::runtime_error("Bad document edges in " + path);
+        }
+    }
+    for (uint64_t e = 0; e < _header->numEdges; ++e) {
+        if (_anchorOffsets[e] > _anchorOffsets[e + 1]) {
+            throw std::runtime_error("Bad anchor offsets in " + path);
+        }
+    }
+    if (_anchorOffsets[_header->numEdges] > _header->anchorBytes) {
+        throw std::runtime_error("Bad anchor offsets in " + path);
+    }
+}
+
+std::optional<size_t> LinkGraphReader::find(uint64_t docNum) const {
+    const GraphDoc* end = _docs + _header->numDocs;
+    const GraphDoc* it = std::lower_bound(
+        _docs, end, docNum,
+        [](const GraphDoc& doc, uint64_t num) { return doc.docNum < num; });
+    if (it == end || it->docNum != docNum) {
+        return std::nullopt;
+    }
+    return it - _docs;
+}
+
+std::vector<LinkGraphReader::OutEdge> LinkGraphReader::edges(size_t i) const {
+    const GraphDoc& doc = _docs[i];
+    std::vector<OutEdge> out;
+    out.reserve(doc.numEdges);
+    size_t pos = doc.edgeOffset;
+    uint64_t fingerprint = 0;
+    for (uint32_t e = 0; e < doc.numEdges; ++e) {
+        uint64_t delta;
+        if (!getVarint(_edges, _header->edgeBytes, pos, delta)) {
+            break;
+        }
+        fingerprint += delta;
+        uint32_t edge = doc.firstEdge + e;
+        uint32_t begin = _anchorOffsets[edge];
+        uint32_t length = _anchorOffsets[edge + 1] - begin;
+        out.push_back({fingerprint, std::string_view(_anchors + begin, length)});
+    }
+    return out;
+}
+
+UrlTableReader::UrlTableReader(const std::string& path) : _file(path) {
+    _header = reinterpret_cast<const UrlTableHeader*>(_file.data());
+    if (_file.size() < sizeof(UrlTableHeader) ||
+        std::memcmp(_header->magic, kUrlMagic, sizeof(kUrlMagic)) != 0 ||
+        _header->version != kVersion) {
+        throw std::runtime_error("Not a url table " + path);
+    }
+    if (_header->numUrls >= _file.size() / sizeof(UrlEntry)) {
+        throw std::runtime_error("Truncated url table " + path);
+    }
+    size_t entriesBytes = (_header->numUrls + 1) * sizeof(UrlEntry);
+    if (_file.size() < sizeof(UrlTableHeader) + entriesBytes) {
+        throw std::runtime_error("Truncated url table " + path);
+    }
+    _entries = reinterpret_cast<const UrlEntry*>(_file.data() +
+                                                 sizeof(UrlTableHeader));
+    _urls = _file.data() + sizeof(UrlTableHeader) + entriesBytes;
+    if (_file.size() - (_urls - _file.data()) != _entries[_header->numUrls].offset) {
+        throw std::runtime_error("Truncated url table " + path);
+    }
+    for (uint64_t i = 0; i < _header->numUrls; ++i) {
+        if (_entries[i].offset > _entries[i + 1].offset) {
+            throw std::runtime_error("Bad url offsets in " + path);
+        }
+    }
+}
+
+std::optional<std::string_view> UrlTableReader::lookup(uint64_t fingerprint) const {
+    const UrlEntry* end = _entries + _header->numUrls;
+    const UrlEntry* it = std::lower_bound(
+        _entries, end, fingerprint,
+        [](const UrlEntry& entry, uint64_t fp) { return entry.fingerprint < fp; });
+    if (it == end || it->fingerprint != fingerprint) {
+        return std::nullopt;
+    }
+    return std::string_view(_urls + it->offset, (it + 1)->offset - it->offset);
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "AsyncWriter.hpp"
+
+// Stable 64-bit fingerprint of a url (FNV-1a over the url without its
+// fragment). The same url maps to the same fingerprint in every segment and
+// every run.
+uint64_t urlFingerprint(const std::string& url);
+
+struct OutLink {
+    std::string url;
+    std::string anchorText;
+};
+
+// Every segment is written as two files that can be mmapped as is:
+//
+// <firstDocNum>.graph
+//   GraphHeader
+//   GraphDoc[numDocs]                 sorted by docNum
+//   uint32_t anchorOffsets[numEdges + 1]
+//   edges                             per doc, varint deltas of its sorted
+//                                     out-edge fingerprints
+//   anchors                           anchor text of edge i is
+//                                     [anchorOffsets[i], anchorOffsets[i + 1])
+//
+// <firstDocNum>.urls
+//   UrlTableHeader
+//   UrlEntry[numUrls + 1]             sorted by fingerprint, the last entry
+//                                     only marks the end of the url blob
+//   urls
+struct GraphHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t numDocs;
+    uint64_t numEdges;
+    uint64_t edgeBytes;
+    uint64_t anchorBytes;
+};
+
+struct GraphDoc {
+    uint64_t docNum;
+    uint64_t fingerprint;
+    // Byte offset of this doc's edges in the edge section
+    uint64_t edgeOffset;
+    uint32_t firstEdge;
+    uint32_t numEdges;
+};
+
+struct UrlTableHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t numUrls;
+};
+
+struct UrlEntry {
+    uint64_t fingerprint;
+    uint64_t offset;
+};
+
+class LinkGraphWriter {
+   public:
+    // Segments are handed to writer when given, otherwise written by the
+    // thread that filled them
+    LinkGraphWriter(std::string outputDir, size_t docsPerSegment,
+                    AsyncWriter* writer = nullptr);
+
+    ~LinkGraphWriter();
+
+    // Charge the documents buffered in the current segment to budget until
+    // the segment is handed off. Set before the first addDocument.
+    void setMemoryBudget(MemoryBudget* budget) { _memory = budget; }
+
+    // Record the out-edges of a document. Safe to call from many threads, the
+    // segment is written out once it holds docsPerSegment documents.
+    void addDocument(uint64_t docNum, const std::string& url,
+                     const std::vector<OutLink>& links);
+
+    // Write out whatever is in the current segment
+    void flush();
+
+   private:
+    struct Edge {
+        uint64_t fingerprint;
+        std::string anchorText;
+    };
+
+    struct PendingDoc {
+        uint64_t docNum;
+        uint64_t fingerprint;
+        // Sorted by fingerprint, no duplicates
+        std::vector<Edge> edges;
+    };
+
+    struct Segment {
+        std::vector<PendingDoc> docs;
+        std::unordered_map<uint64_t, std::string> urls;
+        // Estimated memory held, charged to _memory
+        size_t bytes = 0;
+    };
+
+    void writeSegment(Segment& segment);
+
+    std::string _outputDir;
+    size_t _docsPerSegment;
+    AsyncWriter* _writer;
+    MemoryBudget* _memory = nullptr;
+
+    std::mutex _mutex;
+    Segment _segment;
+};
+
+// Read only mapping of a file, unmapped on destruction
+class MappedFile {
+   public:
+    // Throws std::runtime_error if the file can not be mapped
+    MappedFile(const std::string& path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+   private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+};
+
+class LinkGraphReader {
+   public:
+    struct OutEdge {
+        uint64_t fingerprint;
+        std::string_view anchorText;
+    };
+
+    // Throws std::runtime_error if the file is not a link graph segment
+    LinkGraphReader(const std::string& path);
+
+    size_t size() const { return _header->numDocs; }
+
+    size_t numEdges() const { return _header->numEdges; }
+
+    const GraphDoc& doc(size_t i) const { return _docs[i]; }
+
+    // Index of docNum in this segment
+    std::optional<size_t> find(uint64_t docNum) const;
+
+    std::vector<OutEdge> edges(size_t i) const;
+
+   private:
+    MappedFile _file;
+    const GraphHeader* _header;
+    const GraphDoc* _docs;
+    const uint32_t* _anchorOffsets;
+    const char* _edges;
+    const char* _anchors;
+};
+
+class UrlTableReader {
+   public:
+    // Throws std::runtime_error if the file is not a url table
+    UrlTableReader(const std::string& path);
+
+    size_t size() const { return _header->numUrls; }
+
+    std::optional<std::string_view> lookup(uint64_t fingerprint) const;
+
+   private:
+    MappedFile _file;
+    const UrlTableHeader* _header;
+    const UrlEntry* _entries;
+    const char* _urls;
+};
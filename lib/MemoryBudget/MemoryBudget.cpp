@@ -0,0 +1,156 @@
+#include "MemoryBudget.hpp"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include "AsyncLog.hpp"
+
+MemoryBudget::MemoryBudget(size_t limitBytes) : _limit(limitBytes) {}
+
+void MemoryBudget::updatePeak(size_t value) {
+    size_t peak = _peak;
+    while (value > peak && !_peak.compare_exchange_weak(peak, value)) {
+    }
+}
+
+void MemoryBudget::acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_limit) {
+        _released.wait(lock, [&] {
+            return _acquired == 0 || _current + bytes <= _limit;
+        });
+    }
+    _acquired += bytes;
+    charge(bytes);
+}
+
+void MemoryBudget::releaseAcquired(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _acquired -= bytes;
+    }
+    release(bytes);
+}
+
+void MemoryBudget::charge(size_t bytes) {
+    updatePeak(_current += bytes);
+}
+
+void MemoryBudget::release(size_t bytes) {
+    _current -= bytes;
+    if (_limit) {
+        // Taking the lock orders this with a waiter checking its predicate
+        std::lock_guard<std::mutex> lock(_mutex);
+    }
+    _released.notify_all();
+}
+
+bool MemoryBudget::overBudget() const {
+    return _limit && _current > _limit;
+}
+
+MemoryReservation::MemoryReservation(MemoryBudget* budget, size_t bytes)
+    : _budget(budget), _bytes(budget ? bytes : 0) {
+    if (_budget) {
+        _budget->acquire(_bytes);
+    }
+}
+
+MemoryReservation::~MemoryReservation() {
+    if (_budget) {
+        _budget->releaseAcquired(_bytes);
+    }
+}
+
+void MemoryReservation::resize(size_t bytes) {
+    if (!_budget) {
+        return;
+    }
+    if (bytes > _bytes) {
+        {
+            std::lock_guard<std::mutex> lock(_budget->_mutex);
+            _budget->_acquired += bytes - _bytes;
+        }
+        _budget->charge(bytes - _bytes);
+    } else {
+        _budget->releaseAcquired(_bytes - bytes);
+    }
+    _bytes = bytes;
+}
+
+size_t urlBytes(const std::vector<std::string>& urls) {
+    size_t bytes = urls.capacity() * sizeof(std::string);
+    for (const auto& url : urls) {
+        bytes += url.capacity() + 1;
+    }
+    return bytes;
+}
+
+UrlSpill::UrlSpill(std::string path) : _path(path) {
+    // take() leaves only unsent urls in the file, pick up a previous run's
+    std::ifstream in(_path);
+    std::string line;
+    while (std::getline(in, line)) {
+        ++_numSpilled;
+    }
+}
+
+UrlSpill::~UrlSpill() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_numSpilled == 0) {
+        unlink(_path.c_str());
+    }
+}
+
+void UrlSpill::append(const std::vector<std::string>& urls) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::ofstream out(_path, std::ios::app);
+    for (const auto& url : urls) {
+        out << url << "\n";
+    }
+    if (!out) {
+        AsyncLog::getInstance().error("spill", "write", _path,
+                                      "Error spilling urls");
+        return;
+    }
+    _numSpilled += urls.size();
+}
+
+std::vector<std::string> UrlSpill::take(size_t max) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<std::string> urls;
+    if (_numSpilled == 0) {
+        return urls;
+    }
+    std::ifstream in(_path);
+    std::string line;
+    while (urls.size() < max && std::getline(in, line)) {
+        urls.push_back(line);
+    }
+    _numSpilled -= std::min<uint64_t>(_numSpilled, urls.size());
+    if (_numSpilled == 0 || !in) {
+        // Everything was read back, start the file over
+        std::ofstream truncate(_path, std::ios::trunc);
+        _numSpilled = 0;
+        return urls;
+    }
+
+    // Rewrite the file with the unread tail so a restart never sends the
+    // urls taken here again
+    std::string tmpPath = _path + ".tmp";
+    std::ofstream out(tmpPath, std::ios::trunc);
+    out << in.rdbuf();
+    out.close();
+    if (!out || std::rename(tmpPath.c_str(), _path.c_str()) != 0) {
+        AsyncLog::getInstance().error("spill", "rewrite", _path,
+                                      "Error rewriting spilled urls");
+    }
+    return urls;
+}
+
+uint64_t UrlSpill::size() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _numSpilled;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Tracks bytes in flight across fetch buffers, parse state, queued output and
+// pending urls. Callers estimate their own usage, the budget only adds it up
+// and holds back new work while over the limit.
+class MemoryBudget {
+   public:
+    // A limit of 0 tracks usage without ever waiting
+    MemoryBudget(size_t limitBytes);
+
+    // Charge memory that is already allocated, never waits
+    void charge(size_t bytes);
+
+    void release(size_t bytes);
+
+    bool overBudget() const;
+
+    size_t current() const { return _current; }
+
+    size_t peak() const { return _peak; }
+
+    size_t limit() const { return _limit; }
+
+   private:
+    friend class MemoryReservation;
+
+    // Wait until bytes fit in the budget, then charge them. Only waits while
+    // other reservations are held, memory charged elsewhere may not be
+    // released until this one finishes.
+    void acquire(size_t bytes);
+
+    void releaseAcquired(size_t bytes);
+
+    void updatePeak(size_t value);
+
+    const size_t _limit;
+    std::atomic<size_t> _current{0};
+    // Bytes held by reservations, guarded by _mutex
+    size_t _acquired = 0;
+    std::atomic<size_t> _peak{0};
+
+    std::mutex _mutex;
+    std::condition_variable _released;
+};
+
+// Bytes charged by a scope, released when it ends
+class MemoryReservation {
+   public:
+    // Waits for room in budget, a null budget is not tracked
+    MemoryReservation(MemoryBudget* budget, size_t bytes);
+
+    ~MemoryReservation();
+
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    // Replace the estimate once the real size is known, never waits
+    void resize(size_t bytes);
+
+   private:
+    MemoryBudget* _budget;
+    size_t _bytes;
+};
+
+// Approximate heap usage of a list of urls
+size_t urlBytes(const std::vector<std::string>& urls);
+
+// Discovered urls parked on disk while over budget, handed back a chunk at a
+// time
+class UrlSpill {
+   public:
+    UrlSpill(std::string path);
+
+    ~UrlSpill();
+
+    void append(const std::vector<std::string>& urls);
+
+    // Read back up to max spilled urls, oldest first. The file is left
+    // holding only the urls not read yet.
+    std::vector<std::string> take(size_t max);
+
+    uint64_t size();
+
+   private:
+    std::string _path;
+
+    std::mutex _mutex;
+    uint64_t _numSpilled = 0;
+};
@@ -0,0 +1,270 @@
+#include "Supervisor.hpp"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+static const char kMagic[4] = {'C', 'S', 'T', 'A'};
+static const uint32_t kVersion = 1;
+static const uint64_t kStatsIntervalMs = 30000;
+// A stalled worker gets SIGTERM to flush its output, then SIGKILL after this
+static const uint64_t kTermGraceMs = 10000;
+
+static volatile sig_atomic_t gStopRequested = 0;
+
+static void requestStop(int) {
+    gStopRequested = 1;
+}
+
+uint64_t monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+DocNumAllocator::DocNumAllocator(const std::string& path, uint64_t startDocNum) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Error opening " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (static_cast<size_t>(st.st_size) < sizeof(SharedState) &&
+         ftruncate(fd, sizeof(SharedState)) == -1)) {
+        close(fd);
+        throw std::runtime_error("Error sizing " + path);
+    }
+    void* mapped = mmap(nullptr, sizeof(SharedState), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Error mapping " + path);
+    }
+    _state = static_cast<SharedState*>(mapped);
+
+    // A new file is all zeros, which is a valid state for every atomic
+    if (std::memcmp(_state->magic, kMagic, sizeof(kMagic)) != 0) {
+        std::memcpy(_state->magic, kMagic, sizeof(kMagic));
+        _state->version = kVersion;
+    } else if (_state->version != kVersion) {
+        munmap(mapped, sizeof(SharedState));
+        throw std::runtime_error("Unknown state file version " + path);
+    }
+    uint64_t next = _state->nextDocNum;
+    while (next < startDocNum &&
+           !_state->nextDocNum.compare_exchange_weak(next, startDocNum)) {
+    }
+}
+
+DocNumAllocator::~DocNumAllocator() {
+    msync(_state, sizeof(SharedState), MS_ASYNC);
+    munmap(_state, sizeof(SharedState));
+}
+
+uint64_t DocNumAllocator::allocate(uint64_t count) {
+    return _state->nextDocNum.fetch_add(count);
+}
+
+void DocNumAllocator::heartbeat(int id) {
+    worker(id).heartbeatMs = monotonicMs();
+}
+
+void DocNumAllocator::recordBatch(int id, uint64_t received, uint64_t successful) {
+    WorkerSlot& slot = worker(id);
+    slot.received += received;
+    slot.successful += successful;
+    ++slot.batches;
+    slot.heartbeatMs = monotonicMs();
+}
+
+Supervisor::Supervisor(int numWorkers, DocNumAllocator& allocator,
+                       std::function<void(int)> runWorker, int stallSeconds)
+    : _numWorkers(std::clamp(numWorkers, 1, kMaxWorkers)),
+      _allocator(allocator),
+      _runWorker(runWorker),
+      _stallMs(static_cast<uint64_t>(stallSeconds) * 1000),
+      _pids(_numWorkers, -1),
+      _termSentMs(_numWorkers, 0),
+      _cpuSets(_numWorkers) {
+    // Only nextDocNum carries over from a previous run
+    for (int id = 0; id < _numWorkers; ++id) {
+        WorkerSlot& slot = _allocator.worker(id);
+        slot.pid = 0;
+        slot.received = 0;
+        slot.successful = 0;
+        slot.batches = 0;
+        slot.restarts = 0;
+    }
+
+    // Split the cpus we may run on into one contiguous share per worker
+    std::vector<int> cpus;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &mask)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        return;
+    }
+    for (int id = 0; id < _numWorkers; ++id) {
+        if (static_cast<int>(cpus.size()) < _numWorkers) {
+            _cpuSets[id].push_back(cpus[id % cpus.size()]);
+            continue;
+        }
+        size_t begin = cpus.size() * id / _numWorkers;
+        size_t end = cpus.size() * (id + 1) / _numWorkers;
+        _cpuSets[id].assign(cpus.begin() + begin, cpus.begin() + end);
+    }
+}
+
+pid_t Supervisor::spawn(int id) {
+    WorkerSlot& slot = _allocator.worker(id);
+    // Give the new worker a full stall period to make progress
+    slot.heartbeatMs = monotonicMs();
+    pid_t supervisorPid = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        spdlog::error("Error forking worker {}: {}", id, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        // Go down with the supervisor, unsupervised workers would keep
+        // cutil.sh from restarting it. The supervisor may have died before
+        // the death signal was set.
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) != 0 ||
+            getppid() != supervisorPid) {
+            _exit(1);
+        }
+        if (!_cpuSets[id].empty()) {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            for (int cpu : _cpuSets[id]) {
+                CPU_SET(cpu, &mask);
+            }
+            if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+                spdlog::error("Error pinning worker {}: {}", id, strerror(errno));
+            }
+        }
+        try {
+            _runWorker(id);
+        } catch (const std::exception& e) {
+            spdlog::error("Worker {} failed: {}", id, e.what());
+            _exit(1);
+        }
+        _exit(0);
+    }
+    slot.pid = pid;
+    spdlog::info("Started worker {} (pid {}) on {} cpus", id, pid,
+                 _cpuSets[id].size());
+    return pid;
+}
+
+int Supervisor::run() {
+    signal(SIGTERM, requestStop);
+    signal(SIGINT, requestStop);
+
+    for (int id = 0; id < _numWorkers; ++id) {
+        _pids[id] = spawn(id);
+    }
+
+    uint64_t lastStats = monotonicMs();
+    while (std::any_of(_pids.begin(), _pids.end(), [](pid_t p) { return p > 0; })) {
+        if (gStopRequested) {
+            spdlog::info("Stopping workers");
+            for (pid_t pid : _pids) {
+                if (pid > 0) {
+                    kill(pid, SIGTERM);
+                }
+            }
+            while (wait(nullptr) > 0) {
+            }
+            break;
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto it = std::find(_pids.begin(), _pids.end(), pid);
+            if (it == _pids.end()) {
+                continue;
+            }
+            int id = it - _pids.begin();
+            _allocator.worker(id).pid = 0;
+            _termSentMs[id] = 0;
+            // Workers exit cleanly once the frontier sends END
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                spdlog::info("Worker {} finished", id);
+                *it = -1;
+                continue;
+            }
+            spdlog::warn("Worker {} (pid {}) died with status {}, restarting",
+                         id, pid, status);
+            ++_allocator.worker(id).restarts;
+            *it = spawn(id);
+        }
+
+        uint64_t now = monotonicMs();
+        for (int id = 0; id < _numWorkers; ++id) {
+            if (_pids[id] <= 0) {
+                continue;
+            }
+            // May be newer than now, only ever add to it so that can not wrap
+            uint64_t heartbeat = _allocator.worker(id).heartbeatMs;
+            if (_termSentMs[id] && _termSentMs[id] + kTermGraceMs < now) {
+                spdlog::warn("Worker {} (pid {}) ignored SIGTERM, killing", id,
+                             _pids[id]);
+                kill(_pids[id], SIGKILL);
+                _termSentMs[id] = now;
+            } else if (!_termSentMs[id] && heartbeat + _stallMs < now) {
+                // Reaped and restarted on the next pass
+                spdlog::warn("Worker {} (pid {}) stalled for {}s, stopping", id,
+                             _pids[id], (now - heartbeat) / 1000);
+                kill(_pids[id], SIGTERM);
+                _termSentMs[id] = now;
+            }
+        }
+
+        if (now - lastStats >= kStatsIntervalMs) {
+            logStats();
+            lastStats = now;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    logStats();
+    return 0;
+}
+
+void Supervisor::logStats() {
+    uint64_t received = 0, successful = 0, batches = 0, restarts = 0;
+    int alive = 0;
+    for (int id = 0; id < _numWorkers; ++id) {
+        WorkerSlot& slot = _allocator.worker(id);
+        received += slot.received;
+        successful += slot.successful;
+        batches += slot.batches;
+        restarts += slot.restarts;
+        alive += _pids[id] > 0;
+    }
+    spdlog::info("{}/{} workers alive, {} successful out of {} received in {} "
+                 "batches, {} restarts, next doc number {}",
+                 alive, _numWorkers, successful, received, batches, restarts,
+                 _allocator.next());
+}
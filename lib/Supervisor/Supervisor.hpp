@@ -0,0 +1,98 @@
+#pragma once
+
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+static const int kMaxWorkers = 256;
+
+// Per worker slot in the shared state, written by the worker and read by the
+// supervisor
+struct WorkerSlot {
+    std::atomic<int64_t> pid;
+    // monotonicMs() of the worker's last progress
+    std::atomic<uint64_t> heartbeatMs;
+    // Totals across every restart of this slot
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> successful;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> restarts;
+};
+
+// Layout of the state file. It is mapped shared by the supervisor and every
+// worker, the file keeps nextDocNum across restarts.
+struct SharedState {
+    char magic[4];
+    uint32_t version;
+    std::atomic<uint64_t> nextDocNum;
+    WorkerSlot workers[kMaxWorkers];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared state needs address free atomics");
+
+// Hands out document numbers from a file backed shared mapping so every
+// process on the host, and every restart, gets numbers no one else used
+class DocNumAllocator {
+   public:
+    // Creates path if needed. Numbers start at startDocNum or where the
+    // previous run left off, whichever is larger. Throws std::runtime_error if
+    // the file can not be mapped.
+    DocNumAllocator(const std::string& path, uint64_t startDocNum);
+
+    ~DocNumAllocator();
+
+    DocNumAllocator(const DocNumAllocator&) = delete;
+    DocNumAllocator& operator=(const DocNumAllocator&) = delete;
+
+    // First of count consecutive unused document numbers
+    uint64_t allocate(uint64_t count);
+
+    WorkerSlot& worker(int id) { return _state->workers[id]; }
+
+    // Record that a worker is making progress
+    void heartbeat(int id);
+
+    // Record a finished batch and add its counts to the slot's totals
+    void recordBatch(int id, uint64_t received, uint64_t successful);
+
+    uint64_t next() const { return _state->nextDocNum; }
+
+   private:
+    SharedState* _state;
+};
+
+// Milliseconds on CLOCK_MONOTONIC. Unlike wall time it never steps back and
+// is the same clock in every process on the host.
+uint64_t monotonicMs();
+
+// Forks numWorkers processes running runWorker(workerId), pins each to its
+// share of the cpus, restarts workers that crash or stop heartbeating, and
+// logs their aggregated stats
+class Supervisor {
+   public:
+    Supervisor(int numWorkers, DocNumAllocator& allocator,
+               std::function<void(int)> runWorker, int stallSeconds);
+
+    // Returns once every worker has exited cleanly or a termination signal
+    // was received
+    int run();
+
+   private:
+    pid_t spawn(int id);
+
+    void logStats();
+
+    int _numWorkers;
+    DocNumAllocator& _allocator;
+    std::function<void(int)> _runWorker;
+    uint64_t _stallMs;
+
+    std::vector<pid_t> _pids;
+    // When a stalled worker was sent SIGTERM, 0 if it was not
+    std::vector<uint64_t> _termSentMs;
+    std::vector<std::vector<int>> _cpuSets;
+};
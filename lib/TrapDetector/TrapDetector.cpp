@@ -0,0 +1,341 @@
+#include "TrapDetector.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+#include "AsyncLog.hpp"
+
+static const size_t kMaxPathDepth = 10;
+static const size_t kMaxSegmentRepeats = 2;
+static const size_t kMaxQueryParams = 5;
+static const size_t kMaxQueryVariants = 50;
+static const size_t kMaxUrlsPerPattern = 1000;
+static const uint64_t kDemoteSample = 10;
+// Pages needed before a pattern's duplicate rate is trusted
+static const uint64_t kMinSamples = 10;
+static const size_t kRecentHashes = 8;
+static const int kNearDuplicateBits = 3;
+// Statistics are reset past this many patterns to bound memory, learned
+// patterns are kept
+static const size_t kMaxPatterns = 500000;
+
+static const char* kSessionParams[] = {
+    "sid", "sessid", "sessionid", "session_id", "jsessionid",
+    "phpsessid", "aspsessionid", "cfid", "cftoken"};
+
+const char* trapRuleName(TrapRule rule) {
+    switch (rule) {
+        case TrapRule::Learned:
+            return "learned";
+        case TrapRule::RandomPage:
+            return "random_page";
+        case TrapRule::PathDepth:
+            return "path_depth";
+        case TrapRule::RepeatedSegment:
+            return "repeated_segment";
+        case TrapRule::SessionId:
+            return "session_id";
+        case TrapRule::QueryExplosion:
+            return "query_explosion";
+        case TrapRule::PatternVolume:
+            return "pattern_volume";
+        default:
+            return "unknown";
+    }
+}
+
+static std::string toLower(std::string str) {
+    std::transform(str.begin(), str.end(), str.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return str;
+}
+
+static uint64_t fnv1a(const std::string& str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : str) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+TrapDetector::TrapDetector(std::string stateFile) : _stateFile(stateFile) {
+    std::ifstream in(_stateFile);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) {
+            _learned.insert(line);
+        }
+    }
+}
+
+TrapDetector::~TrapDetector() {
+    save();
+}
+
+TrapDetector::UrlParts TrapDetector::split(const std::string& url) {
+    UrlParts parts;
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    size_t end = url.find_first_of("#", start);
+    if (end == std::string::npos) {
+        end = url.size();
+    }
+    size_t hostEnd = url.find_first_of("/?", start);
+    if (hostEnd == std::string::npos || hostEnd > end) {
+        hostEnd = end;
+    }
+    parts.host = toLower(url.substr(start, hostEnd - start));
+
+    size_t queryStart = url.find('?', hostEnd);
+    if (queryStart == std::string::npos || queryStart > end) {
+        queryStart = end;
+    }
+    parts.path = url.substr(hostEnd, queryStart - hostEnd);
+    if (queryStart < end) {
+        parts.query = url.substr(queryStart + 1, end - queryStart - 1);
+    }
+
+    size_t pos = 0;
+    while (pos < parts.path.size()) {
+        size_t next = parts.path.find('/', pos);
+        if (next == std::string::npos) {
+            next = parts.path.size();
+        }
+        if (next > pos) {
+            parts.segments.push_back(parts.path.substr(pos, next - pos));
+        }
+        pos = next + 1;
+    }
+
+    pos = 0;
+    while (pos < parts.query.size()) {
+        size_t next = parts.query.find('&', pos);
+        if (next == std::string::npos) {
+            next = parts.query.size();
+        }
+        std::string param = parts.query.substr(pos, next - pos);
+        if (!param.empty()) {
+            parts.params.push_back(toLower(param.substr(0, param.find('='))));
+        }
+        pos = next + 1;
+    }
+    return parts;
+}
+
+// Numbers become '#' and id-like segments become '*' so that generated url
+// spaces collapse into a single pattern
+static std::string generalize(const std::string& segment) {
+    size_t digits = std::count_if(segment.begin(), segment.end(),
+                                  [](unsigned char c) { return std::isdigit(c); });
+    bool idChars = std::all_of(segment.begin(), segment.end(), [](unsigned char c) {
+        return std::isalnum(c) || c == '-' || c == '_';
+    });
+    if (segment.size() >= 16 && digits > 0 && idChars) {
+        return "*";
+    }
+    std::string out;
+    for (char c : segment) {
+        if (std::isdigit(static_cast<unsigned char>(c))) {
+            if (out.empty() || out.back() != '#') {
+                out += '#';
+            }
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string TrapDetector::pattern(const UrlParts& parts) {
+    std::string out = parts.host;
+    for (const auto& segment : parts.segments) {
+        out += "/" + generalize(segment);
+    }
+    if (!parts.params.empty()) {
+        std::vector<std::string> names = parts.params;
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        out += "?";
+        for (size_t i = 0; i < names.size(); ++i) {
+            out += (i ? "&" : "") + names[i];
+        }
+    }
+    return out;
+}
+
+uint64_t TrapDetector::simhash(const std::vector<std::string>& words) {
+    int weights[64] = {};
+    for (const auto& word : words) {
+        uint64_t hash = fnv1a(word);
+        for (int bit = 0; bit < 64; ++bit) {
+            weights[bit] += (hash >> bit) & 1 ? 1 : -1;
+        }
+    }
+    uint64_t result = 0;
+    for (int bit = 0; bit < 64; ++bit) {
+        if (weights[bit] > 0) {
+            result |= 1ULL << bit;
+        }
+    }
+    return result;
+}
+
+TrapRule TrapDetector::classify(const UrlParts& parts, const std::string& pattern,
+                                bool& demote) {
+    demote = false;
+    if (_learned.count(pattern)) {
+        return TrapRule::Learned;
+    }
+
+    std::unordered_map<std::string, size_t> repeats;
+    for (const auto& segment : parts.segments) {
+        std::string lower = toLower(segment);
+        if (lower.compare(0, 14, "special:random") == 0) {
+            return TrapRule::RandomPage;
+        }
+        if (lower.find(";jsessionid=") != std::string::npos ||
+            lower.find(";sid=") != std::string::npos) {
+            return TrapRule::SessionId;
+        }
+        if (++repeats[lower] > kMaxSegmentRepeats) {
+            return TrapRule::RepeatedSegment;
+        }
+    }
+    if (parts.segments.size() > kMaxPathDepth) {
+        return TrapRule::PathDepth;
+    }
+    for (const auto& param : parts.params) {
+        for (const char* session : kSessionParams) {
+            if (param == session) {
+                return TrapRule::SessionId;
+            }
+        }
+    }
+
+    HostStats& host = _hosts[parts.host];
+    auto [it, inserted] = host.patterns.try_emplace(pattern);
+    _numPatterns += inserted;
+    PatternStats& stats = it->second;
+
+    demote = true;
+    if (parts.params.size() > kMaxQueryParams) {
+        return TrapRule::QueryExplosion;
+    }
+    if (!parts.query.empty()) {
+        auto [variantsIt, newPath] =
+            host.queryVariants.try_emplace(pattern.substr(0, pattern.find('?')));
+        // Counted with the patterns so the reset bounds these too
+        _numPatterns += newPath;
+        auto& variants = variantsIt->second;
+        uint64_t hash = fnv1a(parts.query);
+        if (variants.size() > kMaxQueryVariants) {
+            if (!variants.count(hash)) {
+                return TrapRule::QueryExplosion;
+            }
+        } else {
+            variants.insert(hash);
+        }
+    }
+    // Only patterns that generalized something describe a url space
+    if (pattern.find_first_of("#*") != std::string::npos) {
+        uint64_t hash = fnv1a(parts.path + "?" + parts.query);
+        if (stats.urls.size() > kMaxUrlsPerPattern) {
+            if (!stats.urls.count(hash)) {
+                return TrapRule::PatternVolume;
+            }
+        } else {
+            stats.urls.insert(hash);
+        }
+    }
+    demote = false;
+    return TrapRule::Count;
+}
+
+bool TrapDetector::allow(const std::string& url) {
+    UrlParts parts = split(url);
+    std::string urlPattern = pattern(parts);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_numPatterns > kMaxPatterns) {
+        _hosts.clear();
+        _numPatterns = 0;
+    }
+    bool demote;
+    TrapRule rule = classify(parts, urlPattern, demote);
+    if (rule == TrapRule::Count) {
+        return true;
+    }
+    if (demote) {
+        PatternStats& stats = _hosts[parts.host].patterns[urlPattern];
+        if (stats.demoted++ % kDemoteSample == 0) {
+            return true;
+        }
+    }
+    ++_suppressed[static_cast<size_t>(rule)];
+    return false;
+}
+
+void TrapDetector::recordContent(const std::string& url,
+                                 const std::vector<std::string>& words) {
+    UrlParts parts = split(url);
+    std::string urlPattern = pattern(parts);
+    uint64_t hash = simhash(words);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto [it, inserted] = _hosts[parts.host].patterns.try_emplace(urlPattern);
+    _numPatterns += inserted;
+    PatternStats& stats = it->second;
+    ++stats.fetched;
+    for (uint64_t other : stats.recent) {
+        if (std::bitset<64>(hash ^ other).count() <= kNearDuplicateBits) {
+            ++stats.duplicates;
+            break;
+        }
+    }
+    stats.recent.push_back(hash);
+    if (stats.recent.size() > kRecentHashes) {
+        stats.recent.pop_front();
+    }
+    if (stats.fetched >= kMinSamples && stats.duplicates * 2 >= stats.fetched &&
+        _learned.insert(urlPattern).second) {
+        _dirty = true;
+    }
+}
+
+void TrapDetector::save() {
+    std::vector<std::string> patterns;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_dirty) {
+            return;
+        }
+        patterns.assign(_learned.begin(), _learned.end());
+        _dirty = false;
+    }
+    std::sort(patterns.begin(), patterns.end());
+
+    std::string tmpPath = _stateFile + ".tmp";
+    std::ofstream out(tmpPath);
+    for (const auto& p : patterns) {
+        out << p << "\n";
+    }
+    out.close();
+    if (!out || std::rename(tmpPath.c_str(), _stateFile.c_str()) != 0) {
+        AsyncLog::getInstance().error("traps", "save", _stateFile,
+                                      "Error saving trap patterns");
+    }
+}
+
+std::vector<std::pair<std::string, uint64_t>> TrapDetector::suppressedCounts() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<std::pair<std::string, uint64_t>> counts;
+    for (size_t i = 0; i < _suppressed.size(); ++i) {
+        counts.emplace_back(trapRuleName(static_cast<TrapRule>(i)), _suppressed[i]);
+    }
+    return counts;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Reasons a discovered url is kept away from the frontier
+enum class TrapRule {
+    Learned,           // pattern learned to yield duplicate content
+    RandomPage,        // endpoints that serve a random page, e.g. Special:Random
+    PathDepth,         // endlessly deep paths
+    RepeatedSegment,   // /a/b/a/b/a/b style loops
+    SessionId,         // session ids in the path or query
+    QueryExplosion,    // too many parameters or parameter permutations
+    PatternVolume,     // calendars and other generated url spaces
+    Count
+};
+
+const char* trapRuleName(TrapRule rule);
+
+// Detects crawler traps from per-host url pattern statistics. A pattern is the
+// host and path with numbers and ids generalized plus the sorted query
+// parameter names, e.g. example.com/calendar/#/#?view.
+//
+// Urls are either dropped, or demoted when a rule only suggests low value.
+// The frontier has no priorities, so demoting forwards only one in
+// kDemoteSample urls of the pattern.
+class TrapDetector {
+   public:
+    // Learned patterns are loaded from and saved to stateFile
+    TrapDetector(std::string stateFile);
+
+    ~TrapDetector();
+
+    // Whether a discovered url should be sent to the frontier
+    bool allow(const std::string& url);
+
+    // Record the words of a fetched page, patterns that keep producing
+    // near-duplicate pages are learned as traps
+    void recordContent(const std::string& url, const std::vector<std::string>& words);
+
+    // Persist learned patterns if any were added since the last save
+    void save();
+
+    // Urls suppressed by each rule so far
+    std::vector<std::pair<std::string, uint64_t>> suppressedCounts();
+
+   private:
+    struct PatternStats {
+        // Distinct urls discovered, capped just past the volume limit
+        std::unordered_set<uint64_t> urls;
+        uint64_t demoted = 0;
+        uint64_t fetched = 0;
+        uint64_t duplicates = 0;
+        // Simhashes of the last few pages fetched from this pattern
+        std::deque<uint64_t> recent;
+    };
+
+    struct HostStats {
+        std::unordered_map<std::string, PatternStats> patterns;
+        // Distinct query strings seen per generalized path, so item pages
+        // with the same query share an entry
+        std::unordered_map<std::string, std::unordered_set<uint64_t>> queryVariants;
+    };
+
+    struct UrlParts {
+        std::string host;
+        std::string path;
+        std::vector<std::string> segments;
+        std::vector<std::string> params;
+        std::string query;
+    };
+
+    static UrlParts split(const std::string& url);
+
+    static std::string pattern(const UrlParts& parts);
+
+    static uint64_t simhash(const std::vector<std::string>& words);
+
+    // Returns Count when no rule matches, requires _mutex
+    TrapRule classify(const UrlParts& parts, const std::string& pattern,
+                      bool& demote);
+
+    std::string _stateFile;
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, HostStats> _hosts;
+    size_t _numPatterns = 0;
+    std::unordered_set<std::string> _learned;
+    bool _dirty = false;
+    std::array<uint64_t, static_cast<size_t>(TrapRule::Count)> _suppressed{};
+};
@@ -0,0 +1,39 @@
+#include "Varint.hpp"
+
+void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void putString(std::string& out, const std::string& str) {
+    putVarint(out, str.size());
+    out.append(str);
+}
+
+bool getVarint(const char* data, size_t size, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= size) {
+            return false;
+        }
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool getString(const char* data, size_t size, size_t& pos, std::string& str) {
+    uint64_t len;
+    if (!getVarint(data, size, pos, len) || len > size - pos) {
+        return false;
+    }
+    str.assign(data + pos, len);
+    pos += len;
+    return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// LEB128 style variable length integers. Small values (term ids, deltas,
+// lengths) take a single byte.
+void putVarint(std::string& out, uint64_t value);
+
+// Append a varint length followed by the bytes of str
+void putString(std::string& out, const std::string& str);
+
+// Decode a varint from data starting at pos and advance pos. Returns false if
+// the buffer ends before the varint does.
+bool getVarint(const char* data, size_t size, size_t& pos, uint64_t& value);
+
+bool getString(const char* data, size_t size, size_t& pos, std::string& str);
@@ -8,6 +8,21 @@
 
 #include "Crawly.hpp"
 
+// Charged for a fetch before its size is known
+static const size_t kFetchEstimate = 1 << 20;
+// Spilled urls sent to the frontier with each batch
+static const size_t kSpilledUrlsPerBatch = 10000;
+
+// Taken by the signal thread, SIGUSR1 only wakes it up at shutdown
+static sigset_t terminationSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    return signals;
+}
+
 bool isEnglish(const std::string& text) {
     for (unsigned char c : text) {
         if (c > 127) {
@@ -26,25 +41,61 @@ std::string get_base_url(const std::string& url) {
     return "";
 }
 
-void writeParsedHtml(std::ofstream& outFile, std::string url, int pageNum,
-                     Parser& htmlParser) {
-    outFile << "URL: " << url << " Doc number: " << pageNum <<"\n";
-    outFile << "<title>\n";
-    for (auto w : htmlParser.getTitle())
-        outFile << w << " ";
-    outFile << "\n</title>\n";
-    outFile << "<words>\n";
-    for (auto w : htmlParser.getWords())
-        outFile << w << " ";
-    outFile << "\n</words>\n";
-    outFile << "<links>\n";
+// Make links relative to the site root absolute
+std::string resolveUrl(const std::string& link, const std::string& pageUrl) {
+    // Protocol relative links name another host, only the scheme comes from
+    // the page
+    if (link.compare(0, 2, "//") == 0) {
+        size_t colon = pageUrl.find("://");
+        return colon == std::string::npos ? link : pageUrl.substr(0, colon + 1) + link;
+    }
+    if (!link.empty() && link[0] == '/') {
+        return get_base_url(pageUrl) + link;
+    }
+    return link;
+}
+
+// Parser hands back anchor text as words
+std::string anchorText(const std::vector<std::string>& words) {
+    std::string text;
+    for (const auto& w : words) {
+        if (!text.empty()) {
+            text += " ";
+        }
+        text += w;
+    }
+    return text;
+}
+
+// Every absolute http(s) link on the page with its anchor text
+std::vector<OutLink> graphLinks(const std::string& pageUrl, Parser& htmlParser) {
+    std::vector<OutLink> links;
+    for (auto link : htmlParser.getUrls()) {
+        std::string u = resolveUrl(link.url, pageUrl);
+        if (u.compare(0, 4, "http") != 0) {
+            continue;
+        }
+        links.push_back({u, anchorText(link.anchorText)});
+    }
+    return links;
+}
+
+// Links kept in the <links> section of the output
+std::vector<std::string> outputLinks(Parser& htmlParser) {
+    std::vector<std::string> links;
     for (auto link : htmlParser.getUrls()) {
         if (link.url.compare(0, 5, "https") != 0 || link.url.size() > 30) {
             continue;
         }
-        outFile << link.url << "\n";
+        links.push_back(link.url);
     }
-    outFile << "</links>\n";
+    return links;
+}
+
+void writeParsedHtml(std::ostream& outFile, std::string url, int pageNum,
+                     Parser& htmlParser) {
+    writeParsedText(outFile, url, pageNum, htmlParser.getTitle(),
+                    htmlParser.getWords(), outputLinks(htmlParser));
 }
 
 void parseHtml(std::string url,
@@ -53,17 +104,21 @@ void parseHtml(std::string url,
                std::shared_ptr<std::unordered_map<std::string, bool>> success,
                std::shared_ptr<std::unordered_map<std::string, bool>> tryAgain,
                int urlNum, 
-               std::mutex* m, std::string outputDir) {
+               std::mutex* m, CrawlContext* context) {
     GetCURL& curlConn = GetCURL::getInstance();
     // GetSSL sslConn(url);
     // Get the html as a string
     // std::optional<std::string> html = sslConn.getHtml();
+    // Hold back new fetches while the worker is over its memory budget
+    MemoryReservation reservation(context->memory, kFetchEstimate);
     std::optional<std::string> html = curlConn.getHtml(url);
     if (!html) {
         // tryAgain->insert({url, true});
         success->insert({url, false});
         return;
     }
+    // The response, the parser's copy of it and the vectors it returns
+    reservation.resize(html->size() * 3);
     Parser htmlParser(*html);
     std::string lang = htmlParser.getLanguage();
     if (lang != "en" && lang != "en-us" && lang != "en-US" && lang != "en-Us") {
@@ -81,54 +136,156 @@ void parseHtml(std::string url,
         return;
     }
 
-    std::ofstream outFile(outputDir + "/" + std::to_string(urlNum) + ".parsed");
-    if (!outFile) {
-        spdlog::error("Error opening file {}", outputDir+"/"+std::to_string(urlNum) + ".parsed");
-        success->insert({url, false});
-        return;
+    if (context->forwardIndex) {
+        context->forwardIndex->addDocument(urlNum, url, title,
+                                           htmlParser.getWords(),
+                                           outputLinks(htmlParser));
+    } else {
+        // Handed to the writer thread so a busy disk never stalls fetching
+        std::ostringstream out;
+        writeParsedHtml(out, url, urlNum, htmlParser);
+        context->writer->submit(
+            context->outputDir + "/" + std::to_string(urlNum) + ".parsed",
+            out.str(), [context, url](bool ok) {
+                if (ok) {
+                    return;
+                }
+                AsyncLog::getInstance().error("write", "page_failed", url,
+                                              "Error writing parsed page");
+                std::lock_guard<std::mutex> lock(context->failedWritesMutex);
+                context->failedWrites.push_back(url);
+            });
+    }
+    if (context->linkGraph) {
+        context->linkGraph->addDocument(urlNum, url, graphLinks(url, htmlParser));
+    }
+    if (context->trapDetector) {
+        context->trapDetector->recordContent(url, htmlParser.getWords());
     }
-    writeParsedHtml(outFile, url, urlNum, htmlParser);
-    outFile.close();
 
-    m->lock();
-    // pthread_mutex_lock(m);
-    // robotsUrls->push_back(temp);
+    // Filter before taking the lock, trap checks have their own
+    std::vector<std::string> keptUrls;
     for (auto newUrl : htmlParser.getUrls()) {
-        std::string u = newUrl.url;
-        if (u[0] == '/') {
-            u = get_base_url(url) + u;
-        }
+        std::string u = resolveUrl(newUrl.url, url);
 
         if (u.compare(0, 5, "https") != 0 || u.size() > 500) {
             continue;
         }
-        newUrls->push_back(u);
+        if (context->trapDetector && !context->trapDetector->allow(u)) {
+            continue;
+        }
+        keptUrls.push_back(u);
+    }
+
+    m->lock();
+    // pthread_mutex_lock(m);
+    // robotsUrls->push_back(temp);
+    if (context->memory->overBudget()) {
+        context->spilledUrls.insert(context->spilledUrls.end(), keptUrls.begin(),
+                                    keptUrls.end());
+    } else {
+        size_t bytes = urlBytes(keptUrls);
+        context->memory->charge(bytes);
+        context->pendingUrlBytes += bytes;
+        newUrls->insert(newUrls->end(), keptUrls.begin(), keptUrls.end());
     }
     // pthread_mutex_unlock(m);
     m->unlock();
     success->insert({url, true});
 }
 
-Crawly::Crawly(std::string serverIp, int serverPort, std::string outputDir, int startDocNum) : 
+Crawly::Crawly(std::string serverIp, int serverPort, std::string outputDir, int startDocNum,
+               CrawlyOptions options) : 
     _client(Client(serverIp, serverPort)),
     // _threads(ThreadPool(numThreads)),
     _frontierIp(serverIp),
     _frontierPort(serverPort),
     _outputDir(outputDir),
-    _docNum(startDocNum) {
-    _logFile.open(outputDir + "/logs.txt");
-    if (!_logFile) {
-        spdlog::error("Error opening logfile");
-        return;
+    _docNum(startDocNum),
+    _docNums(options.docNums),
+    _workerId(options.workerId) {
+    // Block before any thread starts so only _signalThread sees them
+    sigset_t signals = terminationSignals();
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    // Workers share the output directory, keep their own files apart
+    std::string suffix = _workerId >= 0 ? "." + std::to_string(_workerId) : "";
+    AsyncLog::getInstance().open(outputDir + "/logs" + suffix + ".jsonl");
+    _memory = std::make_unique<MemoryBudget>(options.memoryLimitMb << 20);
+    _spill = std::make_unique<UrlSpill>(outputDir + "/spilled_urls" + suffix + ".txt");
+    _writer = std::make_unique<AsyncWriter>(options.useIoUring, options.directIo);
+    _writer->setMemoryBudget(_memory.get());
+    _context.outputDir = outputDir;
+    _context.writer = _writer.get();
+    _context.memory = _memory.get();
+    _context.spill = _spill.get();
+    if (options.outputFormat == "forward") {
+        _forwardIndex = std::make_unique<ForwardIndexWriter>(outputDir, options.segmentDocs,
+                                                             _writer.get());
+        _forwardIndex->setMemoryBudget(_memory.get());
+        _context.forwardIndex = _forwardIndex.get();
+    }
+    if (options.linkGraph) {
+        _linkGraph = std::make_unique<LinkGraphWriter>(outputDir, options.segmentDocs,
+                                                       _writer.get());
+        _linkGraph->setMemoryBudget(_memory.get());
+        _context.linkGraph = _linkGraph.get();
+    }
+    if (options.trapDetection) {
+        _trapDetector = std::make_unique<TrapDetector>(outputDir + "/traps" + suffix + ".txt");
+        _context.trapDetector = _trapDetector.get();
+    }
+    if (_docNums) {
+        _heartbeatThread = std::thread(&Crawly::heartbeatWhileWaiting, this);
     }
-    _logFile << "Error urls\n";
+    _signalThread = std::thread(&Crawly::handleSignals, this);
 }
 
 Crawly::~Crawly() {
+    pthread_kill(_signalThread.native_handle(), SIGUSR1);
+    _signalThread.join();
+    _stopping = true;
+    if (_heartbeatThread.joinable()) {
+        _heartbeatThread.join();
+    }
     spdlog::info("{} successful out of {} received", _numSuccessful, _numReceived);
     spdlog::info("Left off at {}", _docNum);
-    _logFile.flush();
-    _logFile.close();
+    flushOutput();
+}
+
+void Crawly::flushOutput() {
+    if (_forwardIndex) {
+        _forwardIndex->flush();
+    }
+    if (_linkGraph) {
+        _linkGraph->flush();
+    }
+    _writer->drain();
+    AsyncLog::getInstance().flush();
+}
+
+void Crawly::heartbeatWhileWaiting() {
+    // Only while waiting, a batch that hangs should still look stalled
+    while (!_stopping) {
+        if (_waitingForFrontier) {
+            _docNums->heartbeat(_workerId);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+void Crawly::handleSignals() {
+    sigset_t signals = terminationSignals();
+    int sig;
+    if (sigwait(&signals, &sig) != 0 || sig == SIGUSR1) {
+        return;
+    }
+    // Pages in a partial segment were already reported to the frontier as
+    // crawled, write them before going down
+    spdlog::info("Caught signal {}, writing buffered output", sig);
+    flushOutput();
+    // Not a clean exit, the supervisor restarts the worker unless it is
+    // stopping
+    _exit(128 + sig);
 }
 
 
@@ -139,7 +296,9 @@ void Crawly::start() {
     _client.SendMessage(FrontierInterface::Encode(initMessage));
 
     while (true) {
+        _waitingForFrontier = true;
         std::optional<Message> response = _client.GetMessageBlocking();
+        _waitingForFrontier = false;
         if (!response) {
             spdlog::info("Error contacting frontier");
             while (true) {
@@ -149,6 +308,9 @@ void Crawly::start() {
                     break;
                 } catch (const std::runtime_error& e) {
                     spdlog::error("Failed to connect to frontier exiting");
+                    // exit() skips the destructor, buffered segments hold
+                    // pages the frontier was told are crawled
+                    flushOutput();
                     std::this_thread::sleep_for(std::chrono::seconds(10));
                     exit(1);
                 }
@@ -162,6 +324,10 @@ void Crawly::start() {
         if (decoded.type == FrontierMessageType::END) {
             break;
         }
+        if (_docNums) {
+            _docNums->heartbeat(_workerId);
+            _docNum = _docNums->allocate(decoded.urls.size());
+        }
 
         // Set up for sending tasks to worker threads
         auto newUrls = std::make_shared<std::vector<std::string>>();
@@ -175,7 +341,7 @@ void Crawly::start() {
         for (auto url : decoded.urls) {
             // _threads.queue(
             //     Task(parseHtml, url, newUrls, robotsUrls, success, _numReceived, &mutex, _outputDir));
-            threads.emplace_back(parseHtml, url, newUrls, robotsUrls, success, tryAgain, _docNum, &m, _outputDir);
+            threads.emplace_back(parseHtml, url, newUrls, robotsUrls, success, tryAgain, _docNum, &m, &_context);
             _docNum++;
             ++_numReceived;
         }
@@ -189,8 +355,8 @@ void Crawly::start() {
         int batchSuccessCount = 0;
         for (auto [url, success] : *success) {
             if (!success) {
-                spdlog::error("Error getting {}", url);
-                _logFile << url << "\n";
+                AsyncLog::getInstance().error("batch", "failed", url,
+                                              "Error getting url");
             } else {
                 batchSuccessCount++;
                 _numSuccessful++;
@@ -203,11 +369,59 @@ void Crawly::start() {
         //         failed.push_back(url);
         //     }
         // }
+        // Pages counted as crawled whose output was lost since the last batch
+        {
+            std::lock_guard<std::mutex> lock(_context.failedWritesMutex);
+            failed.swap(_context.failedWrites);
+        }
+
+        // Urls spilled while over budget go out a chunk per batch
+        if (!_context.spilledUrls.empty()) {
+            _spill->append(_context.spilledUrls);
+            std::vector<std::string>().swap(_context.spilledUrls);
+        }
+        std::vector<std::string> spilled = _spill->take(kSpilledUrlsPerBatch);
+        newUrls->insert(newUrls->end(), spilled.begin(), spilled.end());
 
         _client.SendMessage(FrontierInterface::Encode(FrontierMessage{FrontierMessageType::URLS, *newUrls, failed}));
-        _logFile.flush();
+        _memory->release(_context.pendingUrlBytes);
+        _context.pendingUrlBytes = 0;
 
         spdlog::info("Batch success rate {}/{}", batchSuccessCount, decoded.urls.size());
+        // Per-batch metrics go to the rotated log, not stdout
+        AsyncLog& logger = AsyncLog::getInstance();
+        if (logger.dropped() > 0) {
+            logger.log(LogLevel::Warn, false, "batch", "log_dropped", "",
+                       fmt::format("{} log records dropped", logger.dropped()));
+        }
+        if (_docNums) {
+            _docNums->recordBatch(_workerId, decoded.urls.size(), batchSuccessCount);
+        }
+        if (_trapDetector) {
+            _trapDetector->save();
+            std::vector<std::string> suppressed;
+            for (auto [rule, count] : _trapDetector->suppressedCounts()) {
+                suppressed.push_back(rule + "=" + std::to_string(count));
+            }
+            logger.info("batch", "traps", "",
+                        fmt::format("Trap urls suppressed {}",
+                                    fmt::join(suppressed, " ")));
+        }
+        logger.info("batch", "memory", "",
+                    fmt::format("Memory in flight {}MB, peak {}MB, budget "
+                                "{}MB, {} urls spilled",
+                                _memory->current() >> 20, _memory->peak() >> 20,
+                                _memory->limit() >> 20, _spill->size()));
+        WriterStats writerStats = _writer->stats();
+        logger.info("batch", "writer", "",
+                    fmt::format("Writer {}: {} written, {} failed, queue "
+                                "depth {} (max {}), latency avg {:.1f}ms "
+                                "max {:.1f}ms",
+                                writerStats.backend, writerStats.completed,
+                                writerStats.failed, writerStats.queueDepth,
+                                writerStats.maxQueueDepth,
+                                writerStats.avgLatencyMs,
+                                writerStats.maxLatencyMs));
     }
 }
 
@@ -231,6 +445,50 @@ int main(int argc, char** argv) {
         .default_value(0)
         .scan<'i', int>();
 
+    program.add_argument("-f", "--format")
+        .default_value(std::string("text"))
+        .help("Output format, text .parsed files or forward index segments");
+
+    program.add_argument("--segmentdocs")
+        .default_value(1000)
+        .help("Documents per forward index and link graph segment")
+        .scan<'i', int>();
+
+    program.add_argument("--linkgraph")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Write link graph segments with anchor text for ranking");
+
+    program.add_argument("--nouring")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Write output with a pwritev thread instead of io_uring");
+
+    program.add_argument("--odirect")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Write large segments with O_DIRECT");
+
+    program.add_argument("--notraps")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Forward discovered urls without crawler trap detection");
+
+    program.add_argument("-w", "--workers")
+        .default_value(0)
+        .help("Run a supervisor forking this many worker processes")
+        .scan<'i', int>();
+
+    program.add_argument("--stallseconds")
+        .default_value(300)
+        .help("Restart workers that make no progress for this long")
+        .scan<'i', int>();
+
+    program.add_argument("-m", "--memorymb")
+        .default_value(0)
+        .help("Memory budget for fetches, parsing, output and pending urls in MB, 0 for no limit")
+        .scan<'i', int>();
+
     try {
         program.parse_args(argc, argv);
     } catch (const std::exception& err) {
@@ -244,13 +502,46 @@ int main(int argc, char** argv) {
     int serverPort = program.get<int>("-p");
     std::string outputDir = program.get<std::string>("-o");
     int startDocumentNum = program.get<int>("-s");
+    CrawlyOptions options;
+    options.outputFormat = program.get<std::string>("-f");
+    options.segmentDocs = program.get<int>("--segmentdocs");
+    options.linkGraph = program.get<bool>("--linkgraph");
+    options.useIoUring = !program.get<bool>("--nouring");
+    options.directIo = program.get<bool>("--odirect");
+    options.trapDetection = !program.get<bool>("--notraps");
+    options.memoryLimitMb = std::max(0, program.get<int>("-m"));
+    int numWorkers = program.get<int>("-w");
+    int stallSeconds = program.get<int>("--stallseconds");
+    if (options.outputFormat != "text" && options.outputFormat != "forward") {
+        std::cerr << "Unknown output format " << options.outputFormat << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
 
     spdlog::info("Server IP {}", serverIp);
     spdlog::info("Server port {}", serverPort);
     spdlog::info("Output directory {}", outputDir);
     spdlog::info("Start url number {}", startDocumentNum);
+    spdlog::info("Output format {}", options.outputFormat);
+    spdlog::info("Memory budget {}MB", options.memoryLimitMb);
+
+    if (numWorkers > 0) {
+        // Persisted next to the output so restarts never reuse a doc number
+        DocNumAllocator docNums(outputDir + "/crawly.state", startDocumentNum);
+        spdlog::info("Supervising {} workers, next doc number {}", numWorkers,
+                     docNums.next());
+        Supervisor supervisor(numWorkers, docNums, [&](int workerId) {
+            CrawlyOptions workerOptions = options;
+            workerOptions.docNums = &docNums;
+            workerOptions.workerId = workerId;
+            Crawly crawly(serverIp, serverPort, outputDir, startDocumentNum, workerOptions);
+            spdlog::info("======= Crawly worker {} Started =======", workerId);
+            crawly.start();
+        }, stallSeconds);
+        return supervisor.run();
+    }
 
-    Crawly crawly(serverIp, serverPort, outputDir, startDocumentNum);
+    Crawly crawly(serverIp, serverPort, outputDir, startDocumentNum, options);
 
     spdlog::info("======= Crawly Started =======");
     crawly.start();
@@ -5,32 +5,95 @@
 #include <sys/un.h>
 #include <signal.h>
 #include <unistd.h>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <thread>
 #include <chrono>
 #include <regex>
+#include <sstream>
 
 #include "FrontierInterface.hpp"
 #include "GetURL.hpp"
 #include "GetSSL.hpp"
 #include "GetCURL.hpp"
 #include "Parser.hpp"
+#include "AsyncLog.hpp"
+#include "AsyncWriter.hpp"
+#include "ForwardIndex.hpp"
+#include "LinkGraph.hpp"
+#include "MemoryBudget.hpp"
+#include "Supervisor.hpp"
+#include "TrapDetector.hpp"
 #include "GatewayClient.cpp"
 #include "ThreadPool.hpp"
 
+struct CrawlyOptions {
+    // "text" writes one .parsed file per page, "forward" writes forward index
+    // segments
+    std::string outputFormat = "text";
+    int segmentDocs = 1000;
+    // Also write link graph segments with anchor text
+    bool linkGraph = false;
+    // Output writer backend, io_uring unless disabled or unavailable
+    bool useIoUring = true;
+    bool directIo = false;
+    // Keep urls matching crawler trap patterns away from the frontier
+    bool trapDetection = true;
+    // 0 tracks memory without limiting it
+    size_t memoryLimitMb = 0;
+    // Set for workers forked by the supervisor, document numbers then come
+    // from the shared allocator instead of counting up from startUrlNum
+    DocNumAllocator* docNums = nullptr;
+    int workerId = -1;
+};
+
+// State shared by every parseHtml thread of a worker
+struct CrawlContext {
+    std::string outputDir;
+    AsyncWriter* writer = nullptr;
+    MemoryBudget* memory = nullptr;
+    // Takes discovered urls while over the memory budget
+    UrlSpill* spill = nullptr;
+    // Urls to spill, written to spill by the main thread after the batch so
+    // fetch threads never wait on the disk. Guarded by the batch mutex.
+    std::vector<std::string> spilledUrls;
+    // Bytes charged for the batch's newUrls, guarded by the batch mutex
+    size_t pendingUrlBytes = 0;
+    // Pages whose .parsed file could not be written, filled by the writer
+    // thread and reported to the frontier as failed with the next batch
+    std::mutex failedWritesMutex;
+    std::vector<std::string> failedWrites;
+    // Set when writing forward index segments instead of .parsed files
+    ForwardIndexWriter* forwardIndex = nullptr;
+    LinkGraphWriter* linkGraph = nullptr;
+    TrapDetector* trapDetector = nullptr;
+};
+
 class Crawly {
    public:
-    Crawly(std::string serverIp, int serverPort, std::string outputDir, int startUrlNum);
+    Crawly(std::string serverIp, int serverPort, std::string outputDir, int startUrlNum,
+           CrawlyOptions options = CrawlyOptions());
 
     ~Crawly();
 
     void start();
 
    private:
+    // Write out buffered segments and everything queued for the writer
+    void flushOutput();
+
+    // Runs on _signalThread, flushes output and exits on SIGTERM or SIGINT
+    void handleSignals();
+
+    // Runs on _heartbeatThread in worker mode, keeps the worker from being
+    // taken for stalled while it waits on an idle frontier
+    void heartbeatWhileWaiting();
+
     Client _client;
 
     // ThreadPool _threads;
@@ -40,11 +103,36 @@ class Crawly {
 
     std::string _outputDir;
 
-    std::ofstream _logFile;
+    // Outlives everything that charges it
+    std::unique_ptr<MemoryBudget> _memory;
+
+    std::unique_ptr<UrlSpill> _spill;
+
+    // Declared before the segment writers so it outlives their final flush
+    std::unique_ptr<AsyncWriter> _writer;
+
+    std::unique_ptr<ForwardIndexWriter> _forwardIndex;
+
+    std::unique_ptr<LinkGraphWriter> _linkGraph;
+
+    std::unique_ptr<TrapDetector> _trapDetector;
+
+    CrawlContext _context;
 
     int _numSuccessful = 0;
     int _numReceived = 0;
     int _docNum = 0;
+
+    DocNumAllocator* _docNums;
+    int _workerId;
+
+    // Set while start() is blocked on the frontier
+    std::atomic<bool> _waitingForFrontier{false};
+    std::atomic<bool> _stopping{false};
+    std::thread _heartbeatThread;
+
+    // Started last, once everything it flushes exists
+    std::thread _signalThread;
 };
 
 // Parse the html at url and add the new urls to the newUrls while holding the mutex
@@ -54,4 +142,4 @@ void parseHtml(std::string url,
                std::shared_ptr<std::unordered_map<std::string, bool>> success,
                std::shared_ptr<std::unordered_map<std::string, bool>> tryAgain,
                int pageNum,
-               std::mutex* m, std::string outputDir);
+               std::mutex* m, CrawlContext* context);
@@ -0,0 +1,52 @@
+#include <spdlog/spdlog.h>
+#include <argparse/argparse.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ForwardIndex.hpp"
+
+// Expand forward index segments back into one .parsed text file per document
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("fwdconvert");
+    program.add_argument("segments")
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .help("Forward index segment files (.fwd)");
+
+    program.add_argument("-o", "--output")
+        .required()
+        .help("Directory to write .parsed files to");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    std::string outputDir = program.get<std::string>("-o");
+    int numWritten = 0;
+    for (const auto& path : program.get<std::vector<std::string>>("segments")) {
+        try {
+            ForwardIndexReader reader(path);
+            for (uint64_t docNum : reader.docNums()) {
+                std::string outPath =
+                    outputDir + "/" + std::to_string(docNum) + ".parsed";
+                std::ofstream outFile(outPath);
+                if (!outFile) {
+                    spdlog::error("Error opening file {}", outPath);
+                    continue;
+                }
+                writeParsedText(outFile, *reader.document(docNum));
+                ++numWritten;
+            }
+            spdlog::info("{}: {} documents, {} terms", path, reader.size(),
+                         reader.terms().size());
+        } catch (const std::runtime_error& e) {
+            spdlog::error("{}", e.what());
+        }
+    }
+    spdlog::info("Wrote {} documents to {}", numWritten, outputDir);
+}